@@ -0,0 +1,1370 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <chrono>
+#include <ctime>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <cstring>
+#include <csignal>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <curl/curl.h>
+#include <nlohmann/json.hpp>
+
+#include "prompt_templates.h"
+#include "server_config.h"
+#include "request_tracing.h"
+#include "structured_output.h"
+
+// For the mock upstream and the server subprocess
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <climits>
+
+using json = nlohmann::json;
+
+// Benchmarks for the server and CLI hot paths. Each subcommand runs offline
+// against synthetic data or a local mock upstream, never the real API.
+
+// CPU time consumed by this process, in nanoseconds
+static uint64_t cpuNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// Run `fn` `iterations` times and return the mean CPU time per call in microseconds
+static double cpuMicrosPerCall(int iterations, const std::function<void()>& fn) {
+    uint64_t start = cpuNanos();
+    for (int i = 0; i < iterations; i++) {
+        fn();
+    }
+    return (cpuNanos() - start) / 1e3 / iterations;
+}
+
+// CLOCK_MONOTONIC in nanoseconds, comparable between this process and its children
+static uint64_t monotonicNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static double elapsedMillis(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+// Minimal OpenAI-compatible upstream on 127.0.0.1. Every request is answered
+// after a fixed delay with a canned completion, so server-side overhead can be
+// measured without network variance or API cost.
+class MockUpstream {
+private:
+    int server_fd;
+    int port;
+    int delay_ms;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> first_byte_ns;
+    std::atomic<uint64_t> streamed_bytes;
+    std::thread accept_thread;
+
+    std::mutex stream_mutex;
+    std::string stream_output;
+    size_t stream_chunk_bytes = 16;
+    int stream_chunk_delay_us = 1000;
+
+    static bool writeAll(int fd, const std::string& data) {
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t n = write(fd, data.data() + written, data.size() - written);
+            if (n <= 0) return false;
+            written += n;
+        }
+        return true;
+    }
+
+    static std::string streamEvent(const json& delta, const json& finish_reason = nullptr) {
+        json event = {
+            {"id", "chatcmpl-mock"},
+            {"object", "chat.completion.chunk"},
+            {"model", "mock"},
+            {"choices", json::array({{{"index", 0}, {"delta", delta}, {"finish_reason", finish_reason}}})}
+        };
+        return "data: " + event.dump() + "\n\n";
+    }
+
+    // Server-sent events carrying the configured output in fragments, as
+    // tool call arguments when the request defines tools, else as content.
+    // Stops early when the client hangs up.
+    void streamResponse(int fd, const json& request) {
+        std::string output;
+        size_t chunk_bytes;
+        int delay_us;
+        {
+            std::lock_guard<std::mutex> lock(stream_mutex);
+            output = stream_output;
+            chunk_bytes = stream_chunk_bytes;
+            delay_us = stream_chunk_delay_us;
+        }
+        std::string tool;
+        if (request.contains("tools") && !request["tools"].empty()) {
+            tool = request["tools"][0]["function"].value("name", "");
+        }
+
+        std::string head = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nConnection: close\r\n\r\n";
+        bool connected = writeAll(fd, head) && writeAll(fd, streamEvent({{"role", "assistant"}}));
+        if (connected && !tool.empty()) {
+            connected = writeAll(fd, streamEvent({{"tool_calls", {{{"index", 0}, {"id", "call_mock"}, {"type", "function"},
+                                                                   {"function", {{"name", tool}, {"arguments", ""}}}}}}}));
+        }
+        for (size_t pos = 0; connected && pos < output.size(); pos += chunk_bytes) {
+            std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+            std::string fragment = output.substr(pos, chunk_bytes);
+            json delta = tool.empty() ? json{{"content", fragment}}
+                                      : json{{"tool_calls", {{{"index", 0}, {"function", {{"arguments", fragment}}}}}}};
+            connected = writeAll(fd, streamEvent(delta));
+            if (connected) {
+                streamed_bytes.fetch_add(fragment.size());
+            }
+        }
+        if (connected) {
+            json usage = {{"id", "chatcmpl-mock"}, {"object", "chat.completion.chunk"}, {"choices", json::array()},
+                          {"usage", {{"prompt_tokens", 100}, {"completion_tokens", output.size() / 4},
+                                     {"total_tokens", 100 + output.size() / 4}}}};
+            writeAll(fd, streamEvent(json::object(), tool.empty() ? "stop" : "tool_calls") +
+                         "data: " + usage.dump() + "\n\ndata: [DONE]\n\n");
+        }
+        close(fd);
+    }
+
+    std::string readRequest(int fd) {
+        std::string request;
+        char buffer[4096];
+        size_t expected = std::string::npos;
+        while (request.size() < expected) {
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n <= 0) break;
+            if (request.empty()) {
+                first_byte_ns.store(monotonicNanos());
+            }
+            request.append(buffer, n);
+            size_t header_end = request.find("\r\n\r\n");
+            if (expected == std::string::npos && header_end != std::string::npos) {
+                size_t length_pos = request.find("Content-Length:");
+                size_t length = length_pos < header_end ? std::strtoul(request.c_str() + length_pos + 15, nullptr, 10) : 0;
+                expected = header_end + 4 + length;
+            }
+        }
+        return request;
+    }
+
+    void respond(int fd) {
+        std::string request = readRequest(fd);
+        requests.fetch_add(1);
+        size_t body_start = request.find("\r\n\r\n");
+        json request_body = json::parse(body_start == std::string::npos ? "" : request.substr(body_start + 4),
+                                        nullptr, false);
+        if (request_body.is_object() && request_body.value("stream", false)) {
+            streamResponse(fd, request_body);
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+
+        double seconds = delay_ms / 1e3;
+        json body = {
+            {"id", "chatcmpl-mock"},
+            {"object", "chat.completion"},
+            {"model", "mock"},
+            {"choices", json::array({{{"index", 0}, {"finish_reason", "stop"},
+                                      {"message", {{"role", "assistant"}, {"content", "mock reply"}}}}})},
+            {"usage", {{"prompt_tokens", request.size() / 4}, {"completion_tokens", 2400 * seconds},
+                       {"total_tokens", request.size() / 4 + 2400 * seconds}}},
+            {"time_info", {{"queue_time", 0.0}, {"prompt_time", 0.0},
+                           {"completion_time", seconds}, {"total_time", seconds}}}
+        };
+        std::string payload = body.dump();
+        std::string response = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nConnection: close\r\n"
+                               "Content-Length: " + std::to_string(payload.size()) + "\r\n\r\n" + payload;
+        size_t written = 0;
+        while (written < response.size()) {
+            ssize_t n = write(fd, response.data() + written, response.size() - written);
+            if (n <= 0) break;
+            written += n;
+        }
+        close(fd);
+    }
+
+public:
+    explicit MockUpstream(int delay_ms) : server_fd(-1), port(0), delay_ms(delay_ms), running(true), requests(0), first_byte_ns(0), streamed_bytes(0) {
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0;
+        socklen_t addrlen = sizeof(address);
+        if (server_fd < 0 || bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+            listen(server_fd, 128) < 0 || getsockname(server_fd, (struct sockaddr *)&address, &addrlen) < 0) {
+            throw std::runtime_error("Failed to start mock upstream");
+        }
+        port = ntohs(address.sin_port);
+
+        accept_thread = std::thread([this]() {
+            while (running) {
+                int fd = accept(server_fd, nullptr, nullptr);
+                if (fd < 0) break;
+                std::thread(&MockUpstream::respond, this, fd).detach();
+            }
+        });
+    }
+
+    ~MockUpstream() {
+        running = false;
+        shutdown(server_fd, SHUT_RDWR);
+        close(server_fd);
+        accept_thread.join();
+    }
+
+    std::string url() const {
+        return "http://127.0.0.1:" + std::to_string(port) + "/v1/chat/completions";
+    }
+
+    uint64_t requestCount() const { return requests.load(); }
+
+    // monotonicNanos() when the most recent request's first byte was read
+    uint64_t lastFirstByteNanos() const { return first_byte_ns.load(); }
+
+    // What streaming requests ("stream": true) receive, `chunk_bytes` at a time
+    void setStream(const std::string& output, size_t chunk_bytes, int chunk_delay_us) {
+        std::lock_guard<std::mutex> lock(stream_mutex);
+        stream_output = output;
+        stream_chunk_bytes = chunk_bytes;
+        stream_chunk_delay_us = chunk_delay_us;
+    }
+
+    // Output bytes delivered to streaming clients so far
+    uint64_t streamedBytes() const { return streamed_bytes.load(); }
+};
+
+// cerebras_server running as a child process against a mock upstream. The
+// server stops when its stdin reaches EOF, so closing the pipe shuts it down.
+class ServerProcess {
+private:
+    pid_t pid;
+    int stdin_fd;
+    int port;
+
+    bool accepting() const {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        bool ok = connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+        close(fd);
+        return ok;
+    }
+
+public:
+    ServerProcess(const std::string& binary, int port, const std::string& upstream,
+                  const std::vector<std::string>& extraArgs = {})
+        : pid(-1), stdin_fd(-1), port(port) {
+        int fds[2];
+        if (pipe(fds) < 0) {
+            throw std::runtime_error("pipe() failed");
+        }
+
+        pid = fork();
+        if (pid == 0) {
+            dup2(fds[0], STDIN_FILENO);
+            close(fds[0]);
+            close(fds[1]);
+            freopen("/dev/null", "w", stdout);
+            setenv("CEREBRAS_API_URL", upstream.c_str(), 1);
+            setenv("CEREBRAS_API_KEY", "mock", 1);
+
+            std::vector<std::string> args = {binary, "--port", std::to_string(port)};
+            args.insert(args.end(), extraArgs.begin(), extraArgs.end());
+            std::vector<char*> argv;
+            for (auto& arg : args) argv.push_back(&arg[0]);
+            argv.push_back(nullptr);
+            execv(binary.c_str(), argv.data());
+            _exit(127);
+        }
+        close(fds[0]);
+        stdin_fd = fds[1];
+
+        for (int i = 0; i < 200 && !accepting(); i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        if (!accepting()) {
+            throw std::runtime_error("Server did not start: " + binary);
+        }
+    }
+
+    ~ServerProcess() {
+        close(stdin_fd);
+        int status;
+        waitpid(pid, &status, 0);
+    }
+
+    std::string baseUrl() const {
+        return "http://127.0.0.1:" + std::to_string(port);
+    }
+
+    // User plus system CPU time used by the server so far
+    double cpuMillis() const {
+        std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+        std::string content((std::istreambuf_iterator<char>(stat)), std::istreambuf_iterator<char>());
+        std::istringstream fields(content.substr(content.rfind(')') + 2));
+        std::string field;
+        unsigned long long utime = 0, stime = 0;
+        for (int i = 3; i <= 15 && fields >> field; i++) {
+            if (i == 14) utime = std::stoull(field);
+            if (i == 15) stime = std::stoull(field);
+        }
+        return (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+    }
+};
+
+static size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::string* s) {
+    s->append((char*)contents, size * nmemb);
+    return size * nmemb;
+}
+
+// POST a JSON body and return the response body
+static std::string postJson(const std::string& url, const std::string& body) {
+    CURL* curl = curl_easy_init();
+    std::string response;
+    struct curl_slist* headers = curl_slist_append(NULL, "Content-Type: application/json");
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    CURLcode res = curl_easy_perform(curl);
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+    if (res != CURLE_OK) {
+        throw std::runtime_error(std::string("POST failed: ") + curl_easy_strerror(res));
+    }
+    return response;
+}
+
+// GET a URL and return the response body
+static std::string getBody(const std::string& url) {
+    CURL* curl = curl_easy_init();
+    std::string response;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    CURLcode res = curl_easy_perform(curl);
+    curl_easy_cleanup(curl);
+    if (res != CURLE_OK) {
+        throw std::runtime_error(std::string("GET failed: ") + curl_easy_strerror(res));
+    }
+    return response;
+}
+
+// Options shared by the benchmarks that drive a server subprocess
+struct BenchOptions {
+    int iterations = 2000;
+    int requests = 16;
+    int concurrency = 4;
+    int delay_ms = 100;
+    int port = 18480;
+    std::string server = "./cerebras_server";
+    std::vector<std::string> clis;
+    int processes = 0;  // shards: most server processes to try, 0 for one per CPU (2 to 8)
+};
+
+// Compare the per-request cost of sending a system prompt as text (parse the
+// client body, rebuild and dump the upstream payload) with referencing a
+// registered template by ID and splicing its pre-escaped bytes.
+static int benchTemplates(int iterations) {
+    PromptTemplateRegistry registry;
+    registry.loadMarkdown("hardware_system_prompts.md");
+    registry.loadMarkdown("ml_optimization_prompts.md");
+    registry.loadMarkdown("diagnostic_troubleshooting_prompts.md");
+
+    // Synthetic templates cover sizes beyond the bundled prompt library
+    std::string paragraph = "- **Role**: Act as a \"CLI\" tool for {{system}}, returning raw results.\n";
+    for (size_t size : {512, 2048, 8192, 32768}) {
+        std::string text;
+        while (text.size() < size) {
+            text += paragraph;
+        }
+        registry.add("synthetic-" + std::to_string(size), "Synthetic", text);
+    }
+
+    const std::string model = "qwen-3-32b";
+    const std::string userPrompt = "Check the fan speed on node 7 and report anomalies.";
+    const std::map<std::string, std::string> vars = {{"system", "cs-3 node 7"}};
+
+    std::cout << std::left << std::setw(34) << "template"
+              << std::right << std::setw(9) << "prompt B"
+              << std::setw(12) << "client B"
+              << std::setw(12) << "client B/id"
+              << std::setw(12) << "upstream B"
+              << std::setw(12) << "json us"
+              << std::setw(12) << "splice us"
+              << std::setw(9) << "speedup" << std::endl;
+
+    for (const auto& info : registry.toJson()) {
+        const PromptTemplate& tpl = *registry.find(info["id"]);
+        std::string systemPrompt = tpl.expand(vars);
+
+        // What a client sends to /api/chat in each mode
+        std::string textBody = json{{"model", model}, {"system_prompt", systemPrompt},
+                                    {"user_prompt", userPrompt}}.dump();
+        std::string idBody = json{{"model", model}, {"system_template", tpl.getId()},
+                                  {"template_vars", vars}, {"user_prompt", userPrompt}}.dump();
+
+        std::string viaJson;
+        double jsonMicros = cpuMicrosPerCall(iterations, [&]() {
+            json request = json::parse(textBody);
+            json payload = {
+                {"messages", json::array({
+                    {{"role", "system"}, {"content", request["system_prompt"]}},
+                    {{"role", "user"}, {"content", request["user_prompt"]}}
+                })},
+                {"model", request["model"]},
+                {"stream", false},
+                {"max_completion_tokens", 16382},
+                {"temperature", 0.7},
+                {"top_p", 0.95}
+            };
+            viaJson = payload.dump();
+        });
+
+        std::string viaSplice;
+        double spliceMicros = cpuMicrosPerCall(iterations, [&]() {
+            json request = json::parse(idBody);
+            const PromptTemplate* found = registry.find(request["system_template"]);
+            viaSplice = spliceChatPayload(request["model"], *found,
+                                          request["template_vars"].get<std::map<std::string, std::string>>(),
+                                          request["user_prompt"], 0.7, 0.95, 16382);
+        });
+
+        if (viaJson != viaSplice) {
+            std::cerr << "Mismatched payloads for " << tpl.getId() << std::endl;
+            return 1;
+        }
+
+        std::cout << std::left << std::setw(34) << tpl.getId()
+                  << std::right << std::setw(9) << tpl.size()
+                  << std::setw(12) << textBody.size()
+                  << std::setw(12) << idBody.size()
+                  << std::setw(12) << viaSplice.size()
+                  << std::fixed << std::setprecision(2)
+                  << std::setw(12) << jsonMicros
+                  << std::setw(12) << spliceMicros
+                  << std::setw(8) << jsonMicros / spliceMicros << "x" << std::endl;
+    }
+
+    return 0;
+}
+
+// Wall clock for N prompts sent one /api/chat at a time, as script.js does,
+// versus a single /api/chat/batch request fanned out under a concurrency cap
+static int benchBatch(const BenchOptions& options) {
+    MockUpstream upstream(options.delay_ms);
+    ServerProcess server(options.server, options.port, upstream.url());
+
+    json items = json::array();
+    for (int i = 0; i < options.requests; i++) {
+        items.push_back({{"model", i % 2 ? "qwen-3-32b" : "llama-3-70b"},
+                         {"system_prompt", "You are a helpful assistant."},
+                         {"user_prompt", "Prompt " + std::to_string(i)}});
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    for (const auto& item : items) {
+        postJson(server.baseUrl() + "/api/chat", item.dump());
+    }
+    double serialMillis = elapsedMillis(started);
+
+    started = std::chrono::steady_clock::now();
+    std::string stream = postJson(server.baseUrl() + "/api/chat/batch",
+                                  json{{"requests", items}, {"concurrency", options.concurrency}}.dump());
+    double batchMillis = elapsedMillis(started);
+
+    int ok = 0;
+    double itemMillis = 0;
+    std::istringstream lines(stream);
+    std::string line;
+    while (std::getline(lines, line)) {
+        json result = json::parse(line);
+        ok += result["status"] == 200;
+        itemMillis += result["latency_ms"].get<double>();
+    }
+
+    std::cout << "requests:            " << options.requests << " (upstream delay " << options.delay_ms << " ms)" << std::endl;
+    std::cout << "serial /api/chat:    " << serialMillis << " ms" << std::endl;
+    std::cout << "batch (x" << options.concurrency << "):         " << batchMillis << " ms, "
+              << ok << "/" << options.requests << " ok, mean item latency "
+              << itemMillis / options.requests << " ms" << std::endl;
+    std::cout << "speedup:             " << serialMillis / batchMillis << "x" << std::endl;
+    std::cout << "upstream requests:   " << upstream.requestCount() << std::endl;
+    return ok == options.requests ? 0 : 1;
+}
+
+// Read-side cost of ConfigStore::snapshot() while a writer publishes new
+// snapshots back to back, against a plain shared pointer copy with no
+// reloads and against std::atomic_load, which goes through a lock pool
+static int benchConfig(const BenchOptions& options) {
+    const int readers = options.concurrency;
+    const uint64_t reads = static_cast<uint64_t>(options.iterations) * 1000;
+
+    // Runs `read` `reads` times on each reader thread; returns ns per read
+    auto measure = [&](const std::function<size_t()>& read, bool reload, ConfigStore& store,
+                       uint64_t& reloads) {
+        std::atomic<bool> done{false};
+        std::atomic<size_t> sink{0};
+        std::thread writer;
+        if (reload) {
+            writer = std::thread([&]() {
+                ServerConfig config = *store.snapshot();
+                while (!done) {
+                    config.workers = config.workers % 8 + 1;
+                    store.publish(config);
+                    reloads++;
+                }
+            });
+        }
+
+        auto started = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int t = 0; t < readers; t++) {
+            threads.emplace_back([&]() {
+                size_t local = 0;
+                for (uint64_t i = 0; i < reads; i++) {
+                    local += read();
+                }
+                sink += local;
+            });
+        }
+        for (auto& thread : threads) thread.join();
+        double nanos = elapsedMillis(started) * 1e6 / reads;
+
+        done = true;
+        if (writer.joinable()) writer.join();
+        return nanos;
+    };
+
+    ConfigStore store(ServerConfig::fromEnvironment());
+    std::shared_ptr<const ServerConfig> fixed = store.snapshot();
+    std::shared_ptr<const ServerConfig> shared = fixed;
+    uint64_t reloads = 0, ignored = 0;
+
+    double baseline = measure([&]() {
+        std::shared_ptr<const ServerConfig> cfg = fixed;
+        return cfg->workers;
+    }, false, store, ignored);
+    double quiet = measure([&]() { return store.snapshot()->workers; }, false, store, ignored);
+    double reloading = measure([&]() { return store.snapshot()->workers; }, true, store, reloads);
+    double locked = measure([&]() { return std::atomic_load(&shared)->workers; }, false, store, ignored);
+
+    std::cout << "readers:                          " << readers << " x " << reads << " reads" << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "shared_ptr copy, no reloads:      " << baseline << " ns/read" << std::endl;
+    std::cout << "snapshot(), no reloads:           " << quiet << " ns/read" << std::endl;
+    std::cout << "snapshot(), continuous reloads:   " << reloading << " ns/read ("
+              << reloads << " reloads)" << std::endl;
+    std::cout << "std::atomic_load, no reloads:     " << locked << " ns/read" << std::endl;
+    return 0;
+}
+
+// Outcome of fetching a set of URLs through one curl multi handle
+struct PageLoad {
+    double millis = 0;
+    long connections = 0;
+    long httpVersion = 0;
+    int failed = 0;
+};
+
+// Fetch every request concurrently, as a browser loads a page: at most
+// `maxConnections` per host, multiplexed onto one connection when allowed.
+// A request with a non-empty body is sent as a JSON POST.
+static PageLoad loadPage(const std::vector<std::pair<std::string, std::string>>& requests,
+                         long httpVersion, bool multiplex, long maxConnections) {
+    CURLM* multi = curl_multi_init();
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, maxConnections);
+    struct curl_slist* headers = curl_slist_append(NULL, "Content-Type: application/json");
+
+    std::vector<std::string> bodies(requests.size());
+    std::vector<CURL*> handles;
+    for (size_t i = 0; i < requests.size(); i++) {
+        CURL* curl = curl_easy_init();
+        curl_easy_setopt(curl, CURLOPT_URL, requests[i].first.c_str());
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, httpVersion);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, multiplex ? 1L : 0L);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &bodies[i]);
+        if (!requests[i].second.empty()) {
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, requests[i].second.c_str());
+        }
+        curl_multi_add_handle(multi, curl);
+        handles.push_back(curl);
+    }
+
+    PageLoad result;
+    auto started = std::chrono::steady_clock::now();
+    int running = 1;
+    while (running) {
+        curl_multi_perform(multi, &running);
+        if (running) {
+            curl_multi_poll(multi, nullptr, 0, 100, nullptr);
+        }
+    }
+    result.millis = elapsedMillis(started);
+
+    int queued;
+    while (CURLMsg* msg = curl_multi_info_read(multi, &queued)) {
+        long status = 0;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+        result.failed += msg->data.result != CURLE_OK || status != 200;
+    }
+    for (CURL* curl : handles) {
+        long connects = 0;
+        curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+        curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &result.httpVersion);
+        result.connections += connects;
+        curl_multi_remove_handle(multi, curl);
+        curl_easy_cleanup(curl);
+    }
+    curl_slist_free_all(headers);
+    curl_multi_cleanup(multi);
+    return result;
+}
+
+// Mean TLS handshake time over fresh connections, in microseconds. With
+// `share` set, connections reuse cached sessions and resume abbreviated.
+static double handshakeMicros(const std::string& url, int connections, CURLSH* share) {
+    curl_off_t total = 0;
+    for (int i = 0; i < connections; i++) {
+        CURL* curl = curl_easy_init();
+        std::string body;
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+        if (share) {
+            curl_easy_setopt(curl, CURLOPT_SHARE, share);
+        } else {
+            curl_easy_setopt(curl, CURLOPT_SSL_SESSIONID_CACHE, 0L);
+        }
+        CURLcode res = curl_easy_perform(curl);
+        curl_off_t connected = 0, established = 0;
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connected);
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &established);
+        curl_easy_cleanup(curl);
+        if (res != CURLE_OK) {
+            throw std::runtime_error(std::string("TLS request failed: ") + curl_easy_strerror(res));
+        }
+        total += established - connected;
+    }
+    return static_cast<double>(total) / connections;
+}
+
+// Full vs resumed TLS handshakes, then one page load (static assets, the
+// template list and N chat requests) over plain HTTP/1.1, TLS HTTP/1.1 with
+// browser-style six connections, and TLS HTTP/2 multiplexed on one connection
+static int benchTls(const BenchOptions& options) {
+    char dir[] = "/tmp/cerebras_bench_XXXXXX";
+    if (!mkdtemp(dir)) {
+        throw std::runtime_error("mkdtemp() failed");
+    }
+    std::string cert = std::string(dir) + "/cert.pem";
+    std::string key = std::string(dir) + "/key.pem";
+    std::string command = "openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost"
+                          " -keyout " + key + " -out " + cert + " >/dev/null 2>&1";
+    if (std::system(command.c_str()) != 0) {
+        throw std::runtime_error("Could not generate a self-signed certificate with openssl");
+    }
+
+    const int tlsPort = options.port + 1;
+    MockUpstream upstream(options.delay_ms);
+    ServerProcess server(options.server, options.port, upstream.url(),
+                         {"--tls-listen", "127.0.0.1:" + std::to_string(tlsPort),
+                          "--tls-cert", cert, "--tls-key", key});
+    std::string plainBase = server.baseUrl();
+    std::string tlsBase = "https://127.0.0.1:" + std::to_string(tlsPort);
+
+    int connections = std::max(1, options.iterations / 20);
+    double full = handshakeMicros(tlsBase + "/styles.css", connections, nullptr);
+    CURLSH* share = curl_share_init();
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    double resumed = handshakeMicros(tlsBase + "/styles.css", connections, share);
+    curl_share_cleanup(share);
+    json stats = json::parse(getBody(plainBase + "/api/stats"));
+
+    auto page = [&](const std::string& base) {
+        std::vector<std::pair<std::string, std::string>> requests = {
+            {base + "/", ""}, {base + "/styles.css", ""}, {base + "/script.js", ""},
+            {base + "/api/templates", ""}};
+        for (int i = 0; i < options.requests; i++) {
+            requests.push_back({base + "/api/chat",
+                                json{{"model", "qwen-3-32b"}, {"system_prompt", "You are a helpful assistant."},
+                                     {"user_prompt", "Prompt " + std::to_string(i)}}.dump()});
+        }
+        return requests;
+    };
+
+    struct Mode {
+        const char* name;
+        std::string base;
+        long version;
+        bool multiplex;
+        long connections;
+    };
+    std::vector<Mode> modes = {
+        {"http/1.1 plain, 6 conns", plainBase, CURL_HTTP_VERSION_1_1, false, 6},
+        {"http/1.1 tls, 6 conns", tlsBase, CURL_HTTP_VERSION_1_1, false, 6},
+        {"h2 tls, multiplexed", tlsBase, CURL_HTTP_VERSION_2TLS, true, 1},
+    };
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "handshakes:          " << connections << " per mode, server counted "
+              << stats["tls"]["handshakes"] << " (" << stats["tls"]["resumed"] << " resumed)" << std::endl;
+    std::cout << "full handshake:      " << full << " us" << std::endl;
+    std::cout << "resumed handshake:   " << resumed << " us (" << full / resumed << "x faster)" << std::endl;
+    std::cout << "page load:           4 assets + " << options.requests << " chats (upstream delay "
+              << options.delay_ms << " ms)" << std::endl;
+
+    int failed = 0;
+    for (const Mode& mode : modes) {
+        PageLoad load = loadPage(page(mode.base), mode.version, mode.multiplex, mode.connections);
+        failed += load.failed;
+        std::cout << "  " << std::left << std::setw(26) << mode.name << std::right
+                  << std::setw(9) << load.millis << " ms, " << load.connections << " connections, "
+                  << (load.httpVersion == CURL_HTTP_VERSION_2_0 ? "h2" : "http/1.1")
+                  << (load.failed ? ", " + std::to_string(load.failed) + " failed" : "") << std::endl;
+    }
+
+    std::remove(cert.c_str());
+    std::remove(key.c_str());
+    rmdir(dir);
+    return failed == 0 ? 0 : 1;
+}
+
+// Tracing overhead with tracing off, tail sampling and always-on export.
+// First in process, for the spans one /api/chat request records (CPU per
+// request, exporter thread included), then end to end against the server.
+static int benchTrace(const BenchOptions& options) {
+    std::string exportFile = "/tmp/cerebras_bench_traces_" + std::to_string(getpid()) + ".jsonl";
+    const std::vector<std::string> modes = {"off", "sample", "always"};
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "in process, " << options.iterations * 10 << " requests of 10 spans:" << std::endl;
+    for (const std::string& mode : modes) {
+        Tracer tracer;
+        tracer.configure(Tracer::parseMode(mode), 1000, 0.01);
+        tracer.startExporter(exportFile);
+
+        std::string sink;
+        int requests = options.iterations * 10;
+        uint64_t started = cpuNanos();
+        for (int i = 0; i < requests; i++) {
+            uint64_t accepted = Tracer::now();
+            RequestTrace trace(tracer, "", "POST /api/chat", accepted);
+            trace.child("queue", accepted, accepted + 1000);
+            trace.child("read", accepted + 1000, accepted + 2000);
+            trace.child("parse", accepted + 2000, accepted + 3000);
+            { Span parse("request.json"); }
+            {
+                Span upstream("upstream", SpanKind::Client);
+                if (upstream.active()) {
+                    sink = upstream.context().traceparent();
+                    upstream.child("upstream.connect", accepted + 3000, accepted + 4000);
+                    upstream.child("upstream.generate", accepted + 4000, accepted + 5000, 200);
+                }
+                upstream.setStatus(200);
+            }
+            { Span reparse("response.json"); }
+            trace.setStatus(200);
+            { Span write("write"); }
+        }
+        tracer.stopExporter();
+        double nanos = static_cast<double>(cpuNanos() - started) / requests;
+
+        json stats = tracer.toJson();
+        std::cout << "  " << std::left << std::setw(8) << mode << std::right << std::setw(10) << nanos
+                  << " ns/request CPU, kept " << stats["kept"] << ", exported " << stats["exported_spans"]
+                  << " spans" << std::endl;
+        std::remove(exportFile.c_str());
+    }
+
+    MockUpstream upstream(options.delay_ms);
+    int requests = options.iterations / 4;
+    std::string body = json{{"model", "qwen-3-32b"}, {"system_prompt", "You are a helpful assistant."},
+                            {"user_prompt", "Hello"}}.dump();
+    std::cout << "end to end, " << requests << " sequential /api/chat (upstream delay "
+              << options.delay_ms << " ms):" << std::endl;
+    int port = options.port;
+    for (const std::string& mode : modes) {
+        ServerProcess server(options.server, port++, upstream.url(),
+                             {"--trace", mode, "--trace-export", exportFile});
+        double cpuBefore = server.cpuMillis();
+        auto started = std::chrono::steady_clock::now();
+        for (int i = 0; i < requests; i++) {
+            postJson(server.baseUrl() + "/api/chat", body);
+        }
+        double millis = elapsedMillis(started);
+        double cpu = server.cpuMillis() - cpuBefore;
+        json stats = json::parse(getBody(server.baseUrl() + "/api/stats"))["tracing"];
+
+        std::cout << "  " << std::left << std::setw(8) << mode << std::right << std::setw(10)
+                  << millis * 1000 / requests << " us/request, server CPU " << cpu * 1000 / requests
+                  << " us/request, kept " << stats["kept"] << std::endl;
+    }
+    std::remove(exportFile.c_str());
+    return 0;
+}
+
+// A user walking the diagnostic prompt sequence step by step, reading each
+// answer before sending the next step, with and without speculative prefetch.
+// Every fourth session stops halfway, leaving its prefetched step unused.
+static int benchSpeculation(const BenchOptions& options) {
+    const std::vector<std::string> steps = {
+        "hardware-diagnostician", "system-performance-analyst", "error-log-interpreter",
+        "network-troubleshooter", "root-cause-analyzer", "recovery-specialist"};
+    const int sessions = std::max(4, options.requests / 4);
+    const auto thinkTime = std::chrono::milliseconds(options.delay_ms);
+
+    struct Mode {
+        const char* name;
+        json speculation;
+    };
+    std::vector<Mode> modes = {
+        {"off", {{"enabled", false}}},
+        {"learned", {{"enabled", true}, {"min_observations", 2}, {"ttl_seconds", 60}}},
+        {"configured", {{"enabled", true}, {"learn", false}, {"sequences", {steps}}, {"ttl_seconds", 60}}},
+    };
+
+    std::string configPath = "/tmp/cerebras_bench_speculation_" + std::to_string(getpid()) + ".json";
+    MockUpstream upstream(options.delay_ms);
+    std::cout << sessions << " sessions of " << steps.size() << " steps, upstream delay " << options.delay_ms
+              << " ms, think time " << options.delay_ms << " ms" << std::endl;
+    std::cout << std::left << std::setw(12) << "mode" << std::right
+              << std::setw(12) << "step 1 ms" << std::setw(14) << "steps 2+ ms"
+              << std::setw(8) << "hits" << std::setw(8) << "issued" << std::setw(10) << "hit rate"
+              << std::setw(10) << "spent" << std::setw(10) << "wasted" << std::endl;
+
+    int port = options.port;
+    for (const Mode& mode : modes) {
+        {
+            std::ofstream config(configPath);
+            config << json{{"speculation", mode.speculation}}.dump();
+        }
+        ServerProcess server(options.server, port++, upstream.url(), {"--config", configPath});
+
+        double firstMillis = 0, followMillis = 0;
+        int firstCount = 0, followCount = 0;
+        for (int s = 0; s < sessions; s++) {
+            size_t length = s % 4 == 3 ? steps.size() / 2 : steps.size();
+            std::string problem = "Session " + std::to_string(s) + ": node 7 fans stuck at 100% after a firmware update";
+            for (size_t step = 0; step < length; step++) {
+                auto started = std::chrono::steady_clock::now();
+                postJson(server.baseUrl() + "/api/chat",
+                         json{{"model", "qwen-3-32b"}, {"system_template", steps[step]},
+                              {"user_prompt", problem}}.dump());
+                double millis = elapsedMillis(started);
+                if (step == 0) {
+                    firstMillis += millis;
+                    firstCount++;
+                } else {
+                    followMillis += millis;
+                    followCount++;
+                }
+                std::this_thread::sleep_for(thinkTime);
+            }
+        }
+
+        json stats = json::parse(getBody(server.baseUrl() + "/api/stats"))["speculation"];
+        std::cout << std::fixed << std::setprecision(1)
+                  << std::left << std::setw(12) << mode.name << std::right
+                  << std::setw(12) << firstMillis / firstCount
+                  << std::setw(14) << followMillis / followCount
+                  << std::setw(8) << stats["hits"].get<uint64_t>()
+                  << std::setw(8) << stats["issued"].get<uint64_t>()
+                  << std::setw(9) << stats["hit_rate"].get<double>() * 100 << "%"
+                  << std::setw(10) << stats["tokens_spent"].get<uint64_t>()
+                  << std::setw(10) << stats["tokens_spent"].get<uint64_t>() - stats["tokens_used"].get<uint64_t>()
+                  << std::endl;
+    }
+    std::remove(configPath.c_str());
+    std::cout << "wasted = tokens spent on prefetches that were never served (including still pending)" << std::endl;
+    return 0;
+}
+
+// Exec-to-first-byte for the CLIs: from just before execv() until the mock
+// upstream reads the first byte of the request, plus the whole run to exit.
+// Pass --cli once per binary to compare builds from different build modes.
+static int benchStartup(const BenchOptions& options) {
+    std::vector<std::string> clis = options.clis;
+    if (clis.empty()) {
+        clis = {"./cerebras_cli", "./cli"};
+    }
+    const int runs = std::max(10, options.iterations / 10);
+
+    MockUpstream upstream(0);
+    std::string dir = "/tmp/cerebras_bench_startup_" + std::to_string(getpid());
+    mkdir(dir.c_str(), 0700);
+    {
+        std::ofstream env(dir + "/.env");
+        env << "CEREBRAS_API_KEY=mock" << std::endl;
+    }
+
+    std::cout << runs << " runs per binary against a mock upstream on 127.0.0.1" << std::endl;
+    std::cout << std::left << std::setw(40) << "binary" << std::right << std::setw(14) << "first byte ms"
+              << std::setw(10) << "p90 ms" << std::setw(10) << "exit ms" << std::endl;
+    std::cout << std::fixed << std::setprecision(3);
+
+    for (const std::string& binary : clis) {
+        if (access(binary.c_str(), X_OK) != 0) {
+            std::cout << std::left << std::setw(40) << binary << std::right << "  not found, skipped" << std::endl;
+            continue;
+        }
+        char resolved[PATH_MAX];
+        std::string path = realpath(binary.c_str(), resolved) ? resolved : binary;
+
+        std::vector<double> firstByte, exited;
+        int failed = 0;
+        // The first runs only warm the page cache
+        for (int run = -3; run < runs; run++) {
+            int timing[2], input[2];
+            if (pipe(timing) < 0 || pipe(input) < 0) {
+                throw std::runtime_error("pipe() failed");
+            }
+            // cli is interactive: one question, then exit
+            const char script[] = "Hello\nexit\n";
+            if (write(input[1], script, sizeof(script) - 1) < 0) {
+                throw std::runtime_error("write() failed");
+            }
+            close(input[1]);
+            uint64_t requestsBefore = upstream.requestCount();
+
+            pid_t pid = fork();
+            if (pid == 0) {
+                dup2(input[0], STDIN_FILENO);
+                close(input[0]);
+                close(timing[0]);
+                freopen("/dev/null", "w", stdout);
+                freopen("/dev/null", "w", stderr);
+                if (chdir(dir.c_str()) < 0) _exit(127);
+                setenv("CEREBRAS_API_URL", upstream.url().c_str(), 1);
+                setenv("CEREBRAS_API_KEY", "mock", 1);
+
+                std::vector<std::string> args = {path, "--system-prompt", "You are a helpful assistant."};
+                std::vector<char*> argv;
+                for (auto& arg : args) argv.push_back(&arg[0]);
+                argv.push_back(nullptr);
+                uint64_t started = monotonicNanos();
+                if (write(timing[1], &started, sizeof(started)) < 0) _exit(127);
+                close(timing[1]);
+                execv(path.c_str(), argv.data());
+                _exit(127);
+            }
+            close(input[0]);
+            close(timing[1]);
+            int status = 0;
+            waitpid(pid, &status, 0);
+            uint64_t ended = monotonicNanos();
+            uint64_t started = 0;
+            bool timed = read(timing[0], &started, sizeof(started)) == sizeof(started);
+            close(timing[0]);
+
+            if (!timed || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+                upstream.requestCount() != requestsBefore + 1) {
+                failed++;
+                continue;
+            }
+            if (run >= 0) {
+                firstByte.push_back((upstream.lastFirstByteNanos() - started) / 1e6);
+                exited.push_back((ended - started) / 1e6);
+            }
+        }
+
+        std::cout << std::left << std::setw(40) << binary << std::right;
+        if (firstByte.empty()) {
+            std::cout << "  every run failed" << std::endl;
+            continue;
+        }
+        std::sort(firstByte.begin(), firstByte.end());
+        std::sort(exited.begin(), exited.end());
+        std::cout << std::setw(14) << firstByte[firstByte.size() / 2]
+                  << std::setw(10) << firstByte[firstByte.size() * 9 / 10]
+                  << std::setw(10) << exited[exited.size() / 2];
+        if (failed) {
+            std::cout << "  (" << failed << " failed runs)";
+        }
+        std::cout << std::endl;
+    }
+
+    std::remove((dir + "/.env").c_str());
+    rmdir(dir.c_str());
+    return 0;
+}
+
+// Tool call arguments for the structured benchmark: `records` inventory
+// entries matching structuredToolSchema()
+static std::string structuredArguments(int records) {
+    static const char* units[] = {"celsius", "rpm", "watts", "percent"};
+    json items = json::array();
+    for (int i = 0; i < records; i++) {
+        items.push_back({{"id", i}, {"name", "sensor-" + std::to_string(i) + " on node " + std::to_string(i % 16)},
+                         {"unit", units[i % 4]}, {"reading", (i * 37 % 1000) / 10.0},
+                         {"tags", {"rack-" + std::to_string(i % 8), "zone-b"}}, {"healthy", i % 5 != 0}});
+    }
+    return json{{"node", "cs-2-node-7"}, {"sensors", items}}.dump();
+}
+
+static json structuredToolSchema() {
+    return json::parse(R"({
+        "type": "object",
+        "properties": {
+            "node": {"type": "string", "maxLength": 64},
+            "sensors": {"type": "array", "items": {
+                "type": "object",
+                "properties": {
+                    "id": {"type": "integer", "minimum": 0},
+                    "name": {"type": "string", "maxLength": 128},
+                    "unit": {"enum": ["celsius", "rpm", "watts", "percent"]},
+                    "reading": {"type": "number", "minimum": 0, "maximum": 100},
+                    "tags": {"type": "array", "items": {"type": "string"}, "maxItems": 8},
+                    "healthy": {"type": "boolean"}
+                },
+                "required": ["id", "name", "unit", "reading"],
+                "additionalProperties": false
+            }}
+        },
+        "required": ["node", "sensors"],
+        "additionalProperties": false
+    })");
+}
+
+// Streaming validation throughput in process, then a mock upstream streaming
+// tool call arguments that go wrong part way through: how much sooner the
+// server gives up validating incrementally than validating the finished call.
+static int benchStructured(const BenchOptions& options) {
+    std::unique_ptr<SchemaNode> schema = SchemaNode::compile(structuredToolSchema());
+    std::string document = structuredArguments(2000);
+    int passes = std::max(1, options.iterations / 100);
+    double megabytes = static_cast<double>(document.size()) * passes / (1024 * 1024);
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "in process, " << passes << " passes over " << document.size() / 1024 << " KB of arguments:" << std::endl;
+    {
+        uint64_t started = cpuNanos();
+        for (int p = 0; p < passes; p++) {
+            json parsed = json::parse(document);
+        }
+        std::cout << "  " << std::left << std::setw(28) << "json::parse, whole" << std::right << std::setw(10)
+                  << megabytes / ((cpuNanos() - started) / 1e9) << " MB/s" << std::endl;
+    }
+    for (size_t chunk : {4, 16, 64, 0}) {
+        size_t step = chunk ? chunk : document.size();
+        bool ok = true;
+        uint64_t started = cpuNanos();
+        for (int p = 0; p < passes; p++) {
+            StreamingJsonValidator validator(schema.get());
+            for (size_t pos = 0; pos < document.size(); pos += step) {
+                validator.feed(document.data() + pos, std::min(step, document.size() - pos));
+            }
+            ok = validator.finish() && ok;
+        }
+        std::string label = "validator, " + (chunk ? std::to_string(chunk) + " byte chunks" : std::string("whole"));
+        std::cout << "  " << std::left << std::setw(28) << label << std::right << std::setw(10)
+                  << megabytes / ((cpuNanos() - started) / 1e9) << " MB/s" << (ok ? "" : "  (rejected!)") << std::endl;
+    }
+
+    // About 8 KB of arguments, 16 bytes (a few tokens) per event
+    const size_t chunkBytes = 16;
+    const int chunkDelayUs = 1000;
+    std::string valid = structuredArguments(64);
+    auto corruptAt = [&](double fraction, const std::string& from, const std::string& to) {
+        std::string output = valid;
+        size_t pos = output.find(from, static_cast<size_t>(output.size() * fraction));
+        output.replace(pos, from.size(), to);
+        return output;
+    };
+    struct Scenario {
+        const char* name;
+        std::string output;
+    };
+    std::vector<Scenario> scenarios = {
+        {"valid", valid},
+        {"syntax error at 10%", corruptAt(0.1, ",\"unit\"", ";\"unit\"")},
+        {"wrong type at 10%", corruptAt(0.1, "\"healthy\":true", "\"healthy\":\"yes\"")},
+        {"wrong type at 90%", corruptAt(0.9, "\"healthy\":true", "\"healthy\":\"yes\"")},
+    };
+
+    json tool = {{"type", "function"},
+                 {"function", {{"name", "record_sensors"}, {"description", "Store sensor readings"},
+                               {"parameters", structuredToolSchema()}}}};
+    std::string body = json{{"model", "qwen-3-32b"}, {"system_prompt", "You are a monitoring agent."},
+                            {"user_prompt", "Record every sensor on node 7"},
+                            {"tools", {tool}}, {"tool_choice", "required"}}.dump();
+
+    std::string configPath = "/tmp/cerebras_bench_structured_" + std::to_string(getpid()) + ".json";
+    int requests = std::max(1, options.requests / 8);
+    MockUpstream upstream(0);
+    std::cout << "end to end, " << valid.size() / 1024 << " KB tool call streamed " << chunkBytes << " bytes every "
+              << chunkDelayUs / 1000.0 << " ms, " << requests << " requests each:" << std::endl;
+    std::cout << std::left << std::setw(22) << "scenario" << std::setw(13) << "validation" << std::right
+              << std::setw(8) << "status" << std::setw(12) << "ms/request" << std::setw(14) << "KB streamed"
+              << std::setw(10) << "saved" << std::endl;
+
+    int port = options.port;
+    std::map<std::string, double> finalMillis;
+    for (const char* mode : {"final", "incremental"}) {
+        {
+            std::ofstream config(configPath);
+            config << json{{"structured_output", {{"validation", mode}}}}.dump();
+        }
+        ServerProcess server(options.server, port++, upstream.url(), {"--config", configPath});
+        for (const Scenario& scenario : scenarios) {
+            upstream.setStream(scenario.output, chunkBytes, chunkDelayUs);
+            uint64_t bytesBefore = upstream.streamedBytes();
+            std::string status;
+            auto started = std::chrono::steady_clock::now();
+            for (int i = 0; i < requests; i++) {
+                json response = json::parse(postJson(server.baseUrl() + "/api/chat", body), nullptr, false);
+                status = response.contains("violation") ? "502" : response.contains("choices") ? "200" : "error";
+            }
+            double millis = elapsedMillis(started) / requests;
+            // The mock notices a cancelled stream on its next write
+            std::this_thread::sleep_for(std::chrono::microseconds(chunkDelayUs * 3));
+            double kilobytes = (upstream.streamedBytes() - bytesBefore) / 1024.0 / requests;
+
+            std::cout << std::left << std::setw(22) << scenario.name << std::setw(13) << mode << std::right
+                      << std::setw(8) << status << std::setw(12) << millis << std::setw(14) << kilobytes;
+            if (std::string(mode) == "final") {
+                finalMillis[scenario.name] = millis;
+            } else {
+                std::cout << std::setw(9) << (1 - millis / finalMillis[scenario.name]) * 100 << "%";
+            }
+            std::cout << std::endl;
+        }
+    }
+    std::remove(configPath.c_str());
+    std::cout << "saved = latency cut by incremental validation relative to final" << std::endl;
+    return 0;
+}
+
+// /api/chat throughput from one server process up to --processes sharing a
+// port, under a fixed pool of client threads for a fixed time each. The
+// usage total in /api/stats must match the requests served, whichever
+// process answers. Then checks that the response cache and rate limits are
+// shared too: identical requests reach the upstream once, and one client's
+// burst is enforced across every process.
+static int benchShards(const BenchOptions& options) {
+    const int maxProcesses = options.processes > 0 ? options.processes
+        : std::max(2, std::min(8, static_cast<int>(std::thread::hardware_concurrency())));
+    const int clients = options.concurrency * 8;
+    const auto runTime = std::chrono::seconds(3);
+    std::vector<int> counts;
+    for (int n = 1; n < maxProcesses; n *= 2) counts.push_back(n);
+    counts.push_back(maxProcesses);
+
+    std::string configPath = "/tmp/cerebras_bench_shards_" + std::to_string(getpid()) + ".json";
+    auto writeConfig = [&](const json& config) {
+        std::ofstream file(configPath);
+        file << config.dump();
+    };
+    std::string body = json{{"model", "qwen-3-32b"}, {"system_prompt", "You are a helpful assistant."},
+                            {"user_prompt", "Hello"}}.dump();
+
+    MockUpstream upstream(options.delay_ms);
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << clients << " client threads, " << runTime.count() << " s per run, upstream delay "
+              << options.delay_ms << " ms, " << std::thread::hardware_concurrency() << " CPUs" << std::endl;
+    std::cout << std::setw(10) << "processes" << std::setw(12) << "req/s" << std::setw(10) << "speedup"
+              << std::setw(10) << "p50 ms" << std::setw(10) << "p99 ms" << std::setw(9) << "errors"
+              << "  shared stats" << std::endl;
+
+    int port = options.port;
+    double baseline = 0;
+    bool consistent = true;
+    writeConfig(json::object());
+    for (int n : counts) {
+        ServerProcess server(options.server, port++, upstream.url(),
+                             {"--config", configPath, "--processes", std::to_string(n)});
+        std::vector<std::vector<double>> latencies(clients);
+        std::atomic<uint64_t> errors{0};
+        auto deadline = std::chrono::steady_clock::now() + runTime;
+        std::vector<std::thread> threads;
+        for (int c = 0; c < clients; c++) {
+            threads.emplace_back([&, c]() {
+                while (std::chrono::steady_clock::now() < deadline) {
+                    auto started = std::chrono::steady_clock::now();
+                    try {
+                        json response = json::parse(postJson(server.baseUrl() + "/api/chat", body), nullptr, false);
+                        if (!response.contains("choices")) {
+                            errors.fetch_add(1);
+                            continue;
+                        }
+                    } catch (const std::exception&) {
+                        errors.fetch_add(1);
+                        continue;
+                    }
+                    latencies[c].push_back(elapsedMillis(started));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        std::vector<double> all;
+        for (const auto& samples : latencies) {
+            all.insert(all.end(), samples.begin(), samples.end());
+        }
+        std::sort(all.begin(), all.end());
+        double rate = all.size() / static_cast<double>(runTime.count());
+        if (n == counts.front()) baseline = rate;
+        uint64_t recorded = json::parse(getBody(server.baseUrl() + "/api/stats"))["total"]["requests"];
+        consistent = consistent && recorded == all.size();
+
+        std::cout << std::setw(10) << n << std::setw(12) << rate << std::setw(9) << rate / baseline << "x"
+                  << std::setw(10) << (all.empty() ? 0 : all[all.size() / 2])
+                  << std::setw(10) << (all.empty() ? 0 : all[all.size() * 99 / 100])
+                  << std::setw(9) << errors.load() << "  " << recorded << " of " << all.size() << " recorded"
+                  << std::endl;
+    }
+
+    std::cout << "shared state across " << maxProcesses << " processes:" << std::endl;
+    {
+        writeConfig({{"response_cache", {{"enabled", true}, {"ttl_seconds", 60}}}});
+        ServerProcess server(options.server, port++, upstream.url(),
+                             {"--config", configPath, "--processes", std::to_string(maxProcesses)});
+        uint64_t before = upstream.requestCount();
+        const int repeats = 20;
+        for (int i = 0; i < repeats; i++) {
+            postJson(server.baseUrl() + "/api/chat", body);
+        }
+        json cache = json::parse(getBody(server.baseUrl() + "/api/stats"))["response_cache"];
+        std::cout << "  response cache: " << repeats << " identical requests, "
+                  << upstream.requestCount() - before << " upstream calls, " << cache["hits"] << " hits" << std::endl;
+    }
+    {
+        const int perMinute = 60, burst = 10, sent = 30;
+        writeConfig({{"rate_limit", {{"requests_per_minute", perMinute}, {"burst", burst}}}});
+        ServerProcess server(options.server, port++, upstream.url(),
+                             {"--config", configPath, "--processes", std::to_string(maxProcesses)});
+        int allowed = 0;
+        for (int i = 0; i < sent; i++) {
+            json response = json::parse(postJson(server.baseUrl() + "/api/chat", body), nullptr, false);
+            allowed += response.contains("choices");
+        }
+        std::cout << "  rate limit " << perMinute << "/min, burst " << burst << ": " << allowed << " of " << sent
+                  << " requests allowed" << std::endl;
+    }
+
+    std::remove(configPath.c_str());
+    return consistent ? 0 : 1;
+}
+
+static void printUsage(const char* argv0) {
+    std::cout << "Usage: " << argv0 << " BENCHMARK [options]" << std::endl;
+    std::cout << "Benchmarks:" << std::endl;
+    std::cout << "  templates               Request CPU and body size: prompt text vs template ID" << std::endl;
+    std::cout << "  batch                   Serial /api/chat vs /api/chat/batch against a mock upstream" << std::endl;
+    std::cout << "  config                  Config snapshot read cost under continuous reloads" << std::endl;
+    std::cout << "  tls                     TLS handshake resumption and HTTP/1.1 vs HTTP/2 page loads" << std::endl;
+    std::cout << "  trace                   Request tracing overhead: off, sample and always" << std::endl;
+    std::cout << "  speculation             Follow-up step latency with and without speculative prefetch" << std::endl;
+    std::cout << "  startup                 CLI exec-to-first-byte and run time against a mock upstream" << std::endl;
+    std::cout << "  structured              Schema validation throughput and early aborts on bad tool calls" << std::endl;
+    std::cout << "  shards                  /api/chat throughput from 1 to N server processes on one port" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  --iterations N          Iterations per measurement (default: 2000)" << std::endl;
+    std::cout << "  --requests N            Requests per run (default: 16)" << std::endl;
+    std::cout << "  --concurrency N         Batch concurrency cap (default: 4)" << std::endl;
+    std::cout << "  --delay MS              Mock upstream response delay (default: 100)" << std::endl;
+    std::cout << "  --port PORT             Port for the server under test (default: 18480)" << std::endl;
+    std::cout << "  --server PATH           Server binary (default: ./cerebras_server)" << std::endl;
+    std::cout << "  --cli PATH              CLI binary for startup; repeatable (default: ./cerebras_cli ./cli)" << std::endl;
+    std::cout << "  --processes N           Most server processes for shards (default: one per CPU, 2 to 8)" << std::endl;
+    std::cout << "  --help                  Show this help message" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::string benchmark = argv[1];
+    BenchOptions options;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--iterations" && i + 1 < argc) {
+            options.iterations = std::stoi(argv[++i]);
+        } else if (arg == "--requests" && i + 1 < argc) {
+            options.requests = std::stoi(argv[++i]);
+        } else if (arg == "--concurrency" && i + 1 < argc) {
+            options.concurrency = std::stoi(argv[++i]);
+        } else if (arg == "--delay" && i + 1 < argc) {
+            options.delay_ms = std::stoi(argv[++i]);
+        } else if (arg == "--port" && i + 1 < argc) {
+            options.port = std::stoi(argv[++i]);
+        } else if (arg == "--server" && i + 1 < argc) {
+            options.server = argv[++i];
+        } else if (arg == "--cli" && i + 1 < argc) {
+            options.clis.push_back(argv[++i]);
+        } else if (arg == "--processes" && i + 1 < argc) {
+            options.processes = std::stoi(argv[++i]);
+        }
+    }
+
+    // A server child that dies early must not kill the benchmark on write
+    signal(SIGPIPE, SIG_IGN);
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    try {
+        if (benchmark == "templates") {
+            return benchTemplates(options.iterations);
+        } else if (benchmark == "batch") {
+            return benchBatch(options);
+        } else if (benchmark == "config") {
+            return benchConfig(options);
+        } else if (benchmark == "tls") {
+            return benchTls(options);
+        } else if (benchmark == "trace") {
+            return benchTrace(options);
+        } else if (benchmark == "speculation") {
+            return benchSpeculation(options);
+        } else if (benchmark == "startup") {
+            return benchStartup(options);
+        } else if (benchmark == "structured") {
+            return benchStructured(options);
+        } else if (benchmark == "shards") {
+            return benchShards(options);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    printUsage(argv[0]);
+    return benchmark == "--help" ? 0 : 1;
+}
@@ -1,37 +1,68 @@
 #include <iostream>
 #include <string>
-#include <fstream>
-#include <sstream>
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
 #include <cstdlib>
 #include <vector>
 #include <stdexcept>
+#include <chrono>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "structured_output.h"
 
 using json = nlohmann::json;
 
-// Callback function for writing received data
-static size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::string* s) {
+// Feed received stream data to the assembler. Returning 0 makes curl abort
+// the transfer once the output has violated its schema. Exceptions must not
+// unwind through curl, so they abort the transfer the same way.
+static size_t StreamCallback(void* contents, size_t size, size_t nmemb, ChatStreamAssembler* assembler) {
     size_t newLength = size * nmemb;
     try {
-        s->append((char*)contents, newLength);
-        return newLength;
-    } catch(std::bad_alloc& e) {
-        // Handle memory problem
+        return assembler->feed(static_cast<const char*>(contents), newLength) ? newLength : 0;
+    } catch (const std::exception& e) {
+        assembler->fail(e.what());
         return 0;
     }
 }
 
+// Read a whole file with plain read(2) rather than an ifstream: this runs
+// on every invocation, and scripts call the CLI in tight loops.
+static bool readFile(const std::string& filePath, std::string& content) {
+    int fd = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        content.append(buffer, n);
+    }
+    close(fd);
+    return n == 0;
+}
+
 // Function to load environment variables from .env file
 void loadEnvFromFile(const std::string& filePath) {
-    std::ifstream file(filePath);
-    if (!file.is_open()) {
+    std::string content;
+    if (!readFile(filePath, content)) {
         std::cerr << "Warning: Could not open .env file at " << filePath << std::endl;
         return;
     }
 
-    std::string line;
-    while (std::getline(file, line)) {
+    size_t start = 0;
+    while (start < content.size()) {
+        size_t end = content.find('\n', start);
+        if (end == std::string::npos) {
+            end = content.size();
+        }
+        std::string line = content.substr(start, end - start);
+        start = end + 1;
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+
         // Skip empty lines and comments
         if (line.empty() || line[0] == '#') {
             continue;
@@ -51,25 +82,40 @@ void loadEnvFromFile(const std::string& filePath) {
                 value.pop_back();
             }
 
-            // Set environment variable
+            // Set environment variable, keeping any value already in the environment
             #ifdef _WIN32
-            _putenv_s(key.c_str(), value.c_str());
+            if (!getenv(key.c_str())) {
+                _putenv_s(key.c_str(), value.c_str());
+            }
             #else
-            setenv(key.c_str(), value.c_str(), 1);
+            setenv(key.c_str(), value.c_str(), 0);
             #endif
         }
     }
 }
 
+// Token usage and server-side timing reported in the final stream chunk
+struct UsageSample {
+    uint64_t prompt_tokens = 0;
+    uint64_t completion_tokens = 0;
+    double completion_time = 0.0;  // seconds, from time_info
+    double total_time = 0.0;
+    double wall_time = 0.0;        // seconds, measured locally around the request
+};
+
 // Cerebras API client class
 class CerebrasClient {
 private:
     std::string apiKey;
+    std::string apiUrl;
     CURL* curl;
+    UsageSample lastUsage;
 
 public:
-    CerebrasClient(const std::string& apiKey) : apiKey(apiKey) {
-        curl_global_init(CURL_GLOBAL_ALL);
+    // curl (and with it OpenSSL) is initialised here, after arguments and
+    // .env are handled, so --help and configuration errors never pay for it
+    CerebrasClient(const std::string& apiKey, const std::string& apiUrl) : apiKey(apiKey), apiUrl(apiUrl) {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
         curl = curl_easy_init();
         if (!curl) {
             throw std::runtime_error("Failed to initialize CURL");
@@ -83,11 +129,16 @@ public:
         curl_global_cleanup();
     }
 
-    void streamChatCompletions(const std::string& model, const std::string& systemPrompt,
-                              double temperature = 0.7, double top_p = 0.95, int max_tokens = 16382) {
+    // Stream a completion, printing content as it arrives and each tool call
+    // as a JSON line once the stream ends. Returns false on failure,
+    // including output that violates the schema in `structured`; the stream
+    // is cut off at the first violation.
+    bool streamChatCompletions(const std::string& model, const std::string& systemPrompt,
+                               const StructuredOutput* structured = nullptr,
+                               double temperature = 0.7, double top_p = 0.95, int max_tokens = 16382) {
         if (!curl) {
             std::cerr << "CURL not initialized" << std::endl;
-            return;
+            return false;
         }
 
         // Prepare JSON payload
@@ -101,6 +152,9 @@ public:
             {"temperature", temperature},
             {"top_p", top_p}
         };
+        if (structured) {
+            structured->addTo(payload);
+        }
 
         std::string payloadStr = payload.dump();
 
@@ -111,69 +165,67 @@ public:
         headers = curl_slist_append(headers, authHeader.c_str());
 
         // Set up CURL options
-        curl_easy_setopt(curl, CURLOPT_URL, "https://api.cerebras.ai/v1/chat/completions");
+        curl_easy_setopt(curl, CURLOPT_URL, apiUrl.c_str());
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payloadStr.c_str());
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, StreamCallback);
 
-        // Process the stream
-        std::string buffer;
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+        // Process the stream as it arrives
+        ChatStreamAssembler assembler(structured && structured->validates() ? structured : nullptr, true);
+        assembler.on_content = [](const std::string& fragment) {
+            std::cout << fragment << std::flush;
+        };
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &assembler);
 
+        lastUsage = UsageSample();
+        auto started = std::chrono::steady_clock::now();
         CURLcode res = curl_easy_perform(curl);
+        lastUsage.wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        curl_slist_free_all(headers);
 
-        if (res != CURLE_OK) {
+        if (res != CURLE_OK && !assembler.failed()) {
             std::cerr << "curl_easy_perform() failed: " << curl_easy_strerror(res) << std::endl;
-        } else {
-            // Process the streamed response
-            // In a real implementation, you would parse the SSE format
-            // Here we're just printing the raw response
-            processStreamResponse(buffer);
+            return false;
+        }
+        if (!assembler.finish()) {
+            std::cerr << std::endl << "Error: model output violates the requested schema: "
+                      << assembler.violation() << std::endl;
+            return false;
+        }
+        if (!assembler.eventStream()) {
+            std::cerr << "Error: unexpected response: " << assembler.rawBody() << std::endl;
+            return false;
         }
 
-        curl_slist_free_all(headers);
-    }
-
-private:
-    void processStreamResponse(const std::string& response) {
-        // Split the response by lines (SSE format)
-        std::istringstream stream(response);
-        std::string line;
-
-        while (std::getline(stream, line)) {
-            // Skip empty lines
-            if (line.empty() || line == "\r") {
-                continue;
+        json completion = assembler.completion();
+        if (completion.contains("error")) {
+            std::cerr << "Error: " << completion["error"].dump() << std::endl;
+            return false;
+        }
+        const json& message = completion["choices"][0]["message"];
+        if (message.contains("tool_calls")) {
+            for (const auto& call : message["tool_calls"]) {
+                json arguments = json::parse(call["function"]["arguments"].get<std::string>(), nullptr, false);
+                std::cout << json{{"tool", call["function"]["name"]},
+                                  {"arguments", arguments.is_discarded() ? call["function"]["arguments"] : arguments}}.dump()
+                          << std::endl;
             }
+        }
 
-            // Check if it's a data line
-            if (line.substr(0, 5) == "data:") {
-                std::string data = line.substr(5);
-
-                // Skip "[DONE]" message
-                if (data == " [DONE]") {
-                    continue;
-                }
-
-                try {
-                    // Parse JSON data
-                    json jsonData = json::parse(data);
-
-                    // Extract content from the delta
-                    if (jsonData.contains("choices") &&
-                        jsonData["choices"].size() > 0 &&
-                        jsonData["choices"][0].contains("delta") &&
-                        jsonData["choices"][0]["delta"].contains("content")) {
-
-                        std::string content = jsonData["choices"][0]["delta"]["content"];
-                        std::cout << content << std::flush;
-                    }
-                } catch (json::parse_error& e) {
-                    // Handle JSON parsing errors
-                    std::cerr << "JSON parse error: " << e.what() << std::endl;
-                }
-            }
+        // The last chunk carries usage and timing for the whole completion
+        if (completion.contains("usage")) {
+            lastUsage.prompt_tokens = completion["usage"].value("prompt_tokens", 0ULL);
+            lastUsage.completion_tokens = completion["usage"].value("completion_tokens", 0ULL);
         }
+        if (completion.contains("time_info")) {
+            lastUsage.completion_time = completion["time_info"].value("completion_time", 0.0);
+            lastUsage.total_time = completion["time_info"].value("total_time", 0.0);
+        }
+        return true;
+    }
+
+    const UsageSample& usage() const {
+        return lastUsage;
     }
 };
 
@@ -189,8 +241,13 @@ int main(int argc, char* argv[]) {
     }
 
     std::string apiKey = apiKeyEnv;
-    std::string model = "qwen-3-32b";
+    const char* apiUrlEnv = std::getenv("CEREBRAS_API_URL");
+    std::string apiUrl = apiUrlEnv ? apiUrlEnv : "https://api.cerebras.ai/v1/chat/completions";
+    const char* modelEnv = std::getenv("CEREBRAS_MODEL");
+    std::string model = modelEnv ? modelEnv : "qwen-3-32b";
     std::string systemPrompt = "";
+    bool showUsage = false;
+    json structuredRequest = json::object();
 
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
@@ -199,19 +256,80 @@ int main(int argc, char* argv[]) {
             model = argv[++i];
         } else if (arg == "--system-prompt" && i + 1 < argc) {
             systemPrompt = argv[++i];
+        } else if (arg == "--usage") {
+            showUsage = true;
+        } else if ((arg == "--tools" || arg == "--response-format") && i + 1 < argc) {
+            std::string value = argv[++i];
+            std::string content;
+            if (arg == "--response-format" && value == "json_object") {
+                structuredRequest["response_format"] = {{"type", "json_object"}};
+                continue;
+            }
+            if (!readFile(value, content)) {
+                std::cerr << "Error: Could not read " << value << std::endl;
+                return 1;
+            }
+            json parsed = json::parse(content, nullptr, false);
+            if (parsed.is_discarded()) {
+                std::cerr << "Error: " << value << " is not valid JSON" << std::endl;
+                return 1;
+            }
+            if (arg == "--tools") {
+                structuredRequest["tools"] = parsed;
+            } else if (parsed.is_object() && (parsed.value("type", json()) == "text" ||
+                                              parsed.value("type", json()) == "json_object" ||
+                                              parsed.value("type", json()) == "json_schema")) {
+                // Already a response_format object
+                structuredRequest["response_format"] = parsed;
+            } else {
+                // A bare JSON schema
+                structuredRequest["response_format"] = {
+                    {"type", "json_schema"},
+                    {"json_schema", {{"name", "response"}, {"strict", true}, {"schema", parsed}}}
+                };
+            }
+        } else if (arg == "--tool-choice" && i + 1 < argc) {
+            std::string choice = argv[++i];
+            if (choice == "auto" || choice == "none" || choice == "required") {
+                structuredRequest["tool_choice"] = choice;
+            } else {
+                structuredRequest["tool_choice"] = {{"type", "function"}, {"function", {{"name", choice}}}};
+            }
         } else if (arg == "--help") {
             std::cout << "Usage: " << argv[0] << " [options]" << std::endl;
             std::cout << "Options:" << std::endl;
-            std::cout << "  --model MODEL           Specify the model to use (default: qwen-3-32b)" << std::endl;
+            std::cout << "  --model MODEL           Specify the model to use (default: $CEREBRAS_MODEL or qwen-3-32b)" << std::endl;
             std::cout << "  --system-prompt PROMPT  Specify the system prompt" << std::endl;
+            std::cout << "  --usage                 Print token usage and throughput to stderr" << std::endl;
+            std::cout << "  --tools FILE            JSON array of tool definitions the model may call" << std::endl;
+            std::cout << "  --tool-choice CHOICE    auto, none, required or the name of a tool to force" << std::endl;
+            std::cout << "  --response-format FMT   json_object, or a FILE with a JSON schema or response_format" << std::endl;
             std::cout << "  --help                  Show this help message" << std::endl;
             return 0;
         }
     }
 
     try {
-        CerebrasClient client(apiKey);
-        client.streamChatCompletions(model, systemPrompt);
+        // Malformed definitions are reported before connecting
+        std::shared_ptr<const StructuredOutput> structured = StructuredOutput::fromRequest(structuredRequest);
+
+        CerebrasClient client(apiKey, apiUrl);
+        bool ok = client.streamChatCompletions(model, systemPrompt, structured.get());
+
+        if (showUsage) {
+            const UsageSample& usage = client.usage();
+            double rate = usage.completion_time > 0 ? usage.completion_tokens / usage.completion_time : 0.0;
+            std::cerr << std::endl << "[usage] model=" << model
+                      << " prompt_tokens=" << usage.prompt_tokens
+                      << " completion_tokens=" << usage.completion_tokens
+                      << " completion_time=" << usage.completion_time << "s"
+                      << " upstream_time=" << usage.total_time << "s"
+                      << " wall_time=" << usage.wall_time << "s"
+                      << " tokens_per_second=" << rate << std::endl;
+        }
+        if (!ok) {
+            return 1;
+        }
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
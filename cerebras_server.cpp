@@ -6,19 +6,38 @@
 #include <map>
 #include <cstdlib>
 #include <cstring>
+#include <cctype>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <queue>
 #include <functional>
 #include <stdexcept>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
 
+#include "prompt_templates.h"
+#include "server_config.h"
+#include "http_transport.h"
+#include "request_tracing.h"
+#include "speculative_prefetch.h"
+#include "structured_output.h"
+#include "process_shards.h"
+
 // For socket programming
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <strings.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
+#include <csignal>
 
 using json = nlohmann::json;
 
@@ -52,21 +71,6 @@ public:
     }
 };
 
-// HTTP request structure
-struct HttpRequest {
-    std::string method;
-    std::string path;
-    std::map<std::string, std::string> headers;
-    std::string body;
-};
-
-// HTTP response structure
-struct HttpResponse {
-    int status_code;
-    std::map<std::string, std::string> headers;
-    std::string body;
-};
-
 // Function to load environment variables from .env file
 void loadEnvFromFile(const std::string& filePath) {
     std::ifstream file(filePath);
@@ -96,11 +100,13 @@ void loadEnvFromFile(const std::string& filePath) {
                 value.pop_back();
             }
 
-            // Set environment variable
+            // Set environment variable, keeping any value already in the environment
             #ifdef _WIN32
-            _putenv_s(key.c_str(), value.c_str());
+            if (!getenv(key.c_str())) {
+                _putenv_s(key.c_str(), value.c_str());
+            }
             #else
-            setenv(key.c_str(), value.c_str(), 1);
+            setenv(key.c_str(), value.c_str(), 0);
             #endif
         }
     }
@@ -118,14 +124,27 @@ static size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::stri
     }
 }
 
+// Feeds a streamed response to its assembler; returning 0 makes curl abort
+// the transfer, which closes the upstream connection and stops generation.
+// Exceptions must not unwind through curl, so they abort the transfer too.
+static size_t StreamCallback(void* contents, size_t size, size_t nmemb, ChatStreamAssembler* assembler) {
+    try {
+        return assembler->feed(static_cast<const char*>(contents), size * nmemb) ? size * nmemb : 0;
+    } catch (const std::exception& e) {
+        assembler->fail(e.what());
+        return 0;
+    }
+}
+
 // Cerebras API client class
 class CerebrasClient {
 private:
     std::string apiKey;
+    std::string url;
     CURL* curl;
 
 public:
-    CerebrasClient(const std::string& apiKey) : apiKey(apiKey) {
+    CerebrasClient(const std::string& apiKey, const std::string& url) : apiKey(apiKey), url(url) {
         curl_global_init(CURL_GLOBAL_ALL);
         curl = curl_easy_init();
         if (!curl) {
@@ -140,9 +159,14 @@ public:
         curl_global_cleanup();
     }
 
+    // With `structured`, tools and response_format are sent along. With an
+    // `assembler`, the response is streamed into it instead of returned, and
+    // the request is cancelled as soon as the assembler reports a violation.
     std::string chatCompletions(const std::string& model, const std::string& systemPrompt,
                               const std::string& userPrompt, double temperature = 0.7,
-                              double top_p = 0.95, int max_tokens = 16382) {
+                              double top_p = 0.95, int max_tokens = 16382,
+                              const StructuredOutput* structured = nullptr,
+                              ChatStreamAssembler* assembler = nullptr) {
         if (!curl) {
             throw std::runtime_error("CURL not initialized");
         }
@@ -154,35 +178,89 @@ public:
                 {{"role", "user"}, {"content", userPrompt}}
             })},
             {"model", model},
-            {"stream", false},
+            {"stream", assembler != nullptr},
             {"max_completion_tokens", max_tokens},
             {"temperature", temperature},
             {"top_p", top_p}
         };
+        if (structured) {
+            structured->addTo(payload);
+        }
 
-        std::string payloadStr = payload.dump();
+        return postChatCompletions(payload.dump(), assembler);
+    }
+
+    // Same request with the system prompt spliced in from a pre-escaped template
+    std::string chatCompletions(const std::string& model, const PromptTemplate& systemTemplate,
+                              const std::map<std::string, std::string>& vars,
+                              const std::string& userPrompt, double temperature = 0.7,
+                              double top_p = 0.95, int max_tokens = 16382,
+                              const StructuredOutput* structured = nullptr,
+                              ChatStreamAssembler* assembler = nullptr) {
+        if (!curl) {
+            throw std::runtime_error("CURL not initialized");
+        }
+
+        return postChatCompletions(spliceChatPayload(model, systemTemplate, vars, userPrompt,
+                                                     temperature, top_p, max_tokens, assembler != nullptr,
+                                                     structured ? structured->payloadMembers() : ""),
+                                   assembler);
+    }
+
+private:
+    std::string postChatCompletions(const std::string& payloadStr, ChatStreamAssembler* assembler) {
+        Span span("upstream", SpanKind::Client);
 
         // Set up headers
         struct curl_slist* headers = NULL;
         headers = curl_slist_append(headers, "Content-Type: application/json");
         std::string authHeader = "Authorization: Bearer " + apiKey;
         headers = curl_slist_append(headers, authHeader.c_str());
+        std::string traceHeader;
+        if (span.active()) {
+            traceHeader = "traceparent: " + span.context().traceparent();
+            headers = curl_slist_append(headers, traceHeader.c_str());
+        }
 
         // Set up CURL options
-        curl_easy_setopt(curl, CURLOPT_URL, "https://api.cerebras.ai/v1/chat/completions");
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payloadStr.c_str());
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
 
         // Process the response
         std::string buffer;
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+        if (assembler) {
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, StreamCallback);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, assembler);
+        } else {
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
+        }
 
+        uint64_t started = Tracer::now();
         CURLcode res = curl_easy_perform(curl);
+        bool cancelled = res == CURLE_WRITE_ERROR && assembler && assembler->failed();
 
         curl_slist_free_all(headers);
 
-        if (res != CURLE_OK) {
+        if (span.active()) {
+            // Split the upstream call using curl's timings, in microseconds from the start
+            curl_off_t connected = 0, app_connected = 0, sent = 0, total = 0;
+            long status = 0;
+            curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connected);
+            curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &app_connected);
+            curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &sent);
+            curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+            span.child("upstream.connect", started, started + std::max(connected, app_connected) * 1000);
+            if (res == CURLE_OK || cancelled) {
+                span.child("upstream.generate", started + sent * 1000, started + total * 1000,
+                           cancelled ? -1 : static_cast<int>(status));
+            }
+            span.setStatus(res == CURLE_OK ? static_cast<int>(status) : -1);
+        }
+
+        if (res != CURLE_OK && !cancelled) {
             throw std::runtime_error(std::string("curl_easy_perform() failed: ") + curl_easy_strerror(res));
         }
 
@@ -190,21 +268,314 @@ public:
     }
 };
 
+// Token usage and server-side timing reported by the upstream for one request
+struct UsageSample {
+    uint64_t prompt_tokens = 0;
+    uint64_t completion_tokens = 0;
+    double queue_time = 0.0;       // seconds, from time_info
+    double prompt_time = 0.0;
+    double completion_time = 0.0;
+    double total_time = 0.0;
+};
+
+// Extract the "usage" and "time_info" objects from an upstream response or stream chunk
+UsageSample extractUsage(const json& response) {
+    UsageSample sample;
+    if (response.contains("usage") && response["usage"].is_object()) {
+        const json& usage = response["usage"];
+        sample.prompt_tokens = usage.value("prompt_tokens", 0ULL);
+        sample.completion_tokens = usage.value("completion_tokens", 0ULL);
+    }
+    if (response.contains("time_info") && response["time_info"].is_object()) {
+        const json& time_info = response["time_info"];
+        sample.queue_time = time_info.value("queue_time", 0.0);
+        sample.prompt_time = time_info.value("prompt_time", 0.0);
+        sample.completion_time = time_info.value("completion_time", 0.0);
+        sample.total_time = time_info.value("total_time", 0.0);
+    }
+    return sample;
+}
+
+// Lock-free usage accumulator. Times are kept in microseconds so that every
+// field can be a plain atomic integer updated with fetch_add.
+struct UsageCounters {
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> prompt_tokens{0};
+    std::atomic<uint64_t> completion_tokens{0};
+    std::atomic<uint64_t> queue_us{0};
+    std::atomic<uint64_t> prompt_us{0};
+    std::atomic<uint64_t> completion_us{0};
+    std::atomic<uint64_t> upstream_us{0};
+    std::atomic<uint64_t> latency_us{0};
+
+    void add(const UsageSample& sample, uint64_t latency, bool ok) {
+        requests.fetch_add(1, std::memory_order_relaxed);
+        if (!ok) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+        }
+        prompt_tokens.fetch_add(sample.prompt_tokens, std::memory_order_relaxed);
+        completion_tokens.fetch_add(sample.completion_tokens, std::memory_order_relaxed);
+        queue_us.fetch_add(static_cast<uint64_t>(sample.queue_time * 1e6), std::memory_order_relaxed);
+        prompt_us.fetch_add(static_cast<uint64_t>(sample.prompt_time * 1e6), std::memory_order_relaxed);
+        completion_us.fetch_add(static_cast<uint64_t>(sample.completion_time * 1e6), std::memory_order_relaxed);
+        upstream_us.fetch_add(static_cast<uint64_t>(sample.total_time * 1e6), std::memory_order_relaxed);
+        latency_us.fetch_add(latency, std::memory_order_relaxed);
+    }
+
+    void reset() {
+        for (auto* counter : {&requests, &errors, &prompt_tokens, &completion_tokens, &queue_us,
+                              &prompt_us, &completion_us, &upstream_us, &latency_us}) {
+            counter->store(0, std::memory_order_relaxed);
+        }
+    }
+
+    json toJson() const {
+        uint64_t n = requests.load(std::memory_order_relaxed);
+        uint64_t completion = completion_tokens.load(std::memory_order_relaxed);
+        uint64_t completion_time = completion_us.load(std::memory_order_relaxed);
+        uint64_t latency = latency_us.load(std::memory_order_relaxed);
+        return {
+            {"requests", n},
+            {"errors", errors.load(std::memory_order_relaxed)},
+            {"prompt_tokens", prompt_tokens.load(std::memory_order_relaxed)},
+            {"completion_tokens", completion},
+            {"queue_time_s", queue_us.load(std::memory_order_relaxed) / 1e6},
+            {"prompt_time_s", prompt_us.load(std::memory_order_relaxed) / 1e6},
+            {"completion_time_s", completion_time / 1e6},
+            {"upstream_time_s", upstream_us.load(std::memory_order_relaxed) / 1e6},
+            // Generation speed as measured by the upstream, and as seen end to end by our clients
+            {"tokens_per_second", completion_time ? completion * 1e6 / completion_time : 0.0},
+            {"end_to_end_tokens_per_second", latency ? completion * 1e6 / latency : 0.0},
+            {"avg_latency_ms", n ? latency / 1e3 / n : 0.0}
+        };
+    }
+};
+
+// Fixed-capacity, insert-only table of named counters. Slots are claimed with a
+// CAS on the key hash, so lookups and inserts never block; a slot only matches
+// once its stored name does too, so names whose hashes collide keep separate
+// counters. Names are cut to kMaxName - 1 bytes, and once the table is full
+// new names are folded into a shared overflow slot. The claim also records
+// the claiming pid, so a slot whose shard died before publishing its name is
+// claimed again rather than waited on.
+template<size_t N>
+class UsageTable {
+private:
+    static constexpr size_t kMaxName = 64;
+
+    static constexpr int kReadySpins = 1000;
+
+    struct Slot {
+        std::atomic<uint64_t> claim{0};  // claiming pid << 32 | name hash; 0 while free
+        std::atomic<bool> ready{false};
+        char name[kMaxName] = {0};
+        UsageCounters counters;
+    };
+
+    Slot slots[N];
+    UsageCounters overflow;
+
+    static uint32_t hashName(const std::string& name) {
+        // 32-bit FNV-1a; 0 is reserved for empty slots
+        uint32_t h = 2166136261U;
+        for (unsigned char c : name) {
+            h = (h ^ c) * 16777619U;
+        }
+        return h ? h : 1;
+    }
+
+    // Claimed, and the claimer exited without publishing the name. The name
+    // is published before the claimer can exit, so `ready` is checked again
+    // once the claimer is known to be gone.
+    static bool abandoned(const Slot& slot, uint64_t claim) {
+        return claim != 0 && !slot.ready.load(std::memory_order_acquire) &&
+               sharedWriterGone(static_cast<uint32_t>(claim >> 32)) &&
+               !slot.ready.load(std::memory_order_acquire);
+    }
+
+public:
+    UsageCounters& get(const std::string& full_name) {
+        std::string name = full_name.substr(0, kMaxName - 1);
+        uint32_t h = hashName(name);
+        uint64_t mine = static_cast<uint64_t>(getpid()) << 32 | h;
+        for (size_t i = 0; i < N; i++) {
+            Slot& slot = slots[(h + i) % N];
+            uint64_t current = slot.claim.load(std::memory_order_acquire);
+            // The claiming thread writes the name right after its CAS, so the
+            // wait for it is normally a few instructions long
+            for (int spin = 0; ; spin++) {
+                if (current == 0 || abandoned(slot, current)) {
+                    if (slot.claim.compare_exchange_strong(current, mine, std::memory_order_acq_rel)) {
+                        std::memcpy(slot.name, name.c_str(), name.size() + 1);
+                        slot.ready.store(true, std::memory_order_release);
+                        return slot.counters;
+                    }
+                    continue;
+                }
+                if (static_cast<uint32_t>(current) != h) {
+                    break;
+                }
+                if (slot.ready.load(std::memory_order_acquire)) {
+                    if (name.compare(slot.name) == 0) {
+                        return slot.counters;
+                    }
+                    break;
+                }
+                if (spin == kReadySpins) {
+                    // A claimer that is alive but stalled; count here for now
+                    return overflow;
+                }
+                std::this_thread::yield();
+                current = slot.claim.load(std::memory_order_acquire);
+            }
+        }
+        return overflow;
+    }
+
+    json toJson() const {
+        json result = json::object();
+        for (const Slot& slot : slots) {
+            if (slot.ready.load(std::memory_order_acquire)) {
+                result[slot.name] = slot.counters.toJson();
+            }
+        }
+        if (overflow.requests.load(std::memory_order_relaxed) > 0) {
+            result["(other)"] = overflow.toJson();
+        }
+        return result;
+    }
+};
+
+// Aggregates upstream usage per model, per client and per one-minute window
+class UsageStats {
+private:
+    static constexpr size_t kWindows = 60;
+
+    struct Window {
+        std::atomic<int64_t> minute{-1};
+        UsageCounters counters;
+    };
+
+    std::chrono::steady_clock::time_point started;
+    UsageCounters total;
+    UsageTable<64> models;
+    UsageTable<256> clients;
+    Window windows[kWindows];
+
+    int64_t currentMinute() const {
+        return std::chrono::duration_cast<std::chrono::minutes>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    UsageStats() : started(std::chrono::steady_clock::now()) {}
+
+    void record(const std::string& model, const std::string& client,
+                const UsageSample& sample, uint64_t latency_us, bool ok) {
+        total.add(sample, latency_us, ok);
+        models.get(model).add(sample, latency_us, ok);
+        clients.get(client).add(sample, latency_us, ok);
+
+        // Recycle the ring slot when a new minute starts. A request racing with
+        // the reset may be dropped from the window; the totals stay exact.
+        int64_t minute = currentMinute();
+        Window& window = windows[minute % kWindows];
+        int64_t seen = window.minute.load(std::memory_order_acquire);
+        if (seen != minute && window.minute.compare_exchange_strong(seen, minute, std::memory_order_acq_rel)) {
+            window.counters.reset();
+        }
+        window.counters.add(sample, latency_us, ok);
+    }
+
+    json toJson() const {
+        int64_t now = currentMinute();
+        json windowList = json::array();
+        for (int64_t minute = now - static_cast<int64_t>(kWindows) + 1; minute <= now; minute++) {
+            const Window& window = windows[minute % kWindows];
+            if (window.minute.load(std::memory_order_acquire) == minute) {
+                json entry = window.counters.toJson();
+                entry["minute"] = minute * 60;
+                windowList.push_back(entry);
+            }
+        }
+
+        return {
+            {"uptime_s", std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::steady_clock::now() - started).count()},
+            {"total", total.toJson()},
+            {"models", models.toJson()},
+            {"clients", clients.toJson()},
+            {"windows", windowList},
+            {"current_minute", now * 60}
+        };
+    }
+};
+
+// State every process of a --processes N deployment shares: usage metrics,
+// per-client rate-limit buckets and cached responses. It lives in one shared
+// mapping made before the processes are forked, so a single process uses it
+// the same way.
+struct SharedState {
+    UsageStats usage;
+    StructuredOutputStats structured;
+    RateLimiter<4096> rate_limits;
+    ResponseCache<1024, 64 * 1024> responses;
+};
+
+// Address to listen on, e.g. "0.0.0.0:8080", "[::]:8443" or "unix:/run/cerebras.sock"
+struct ListenerSpec {
+    std::string spec;
+    bool tls;
+    int fd = -1;  // already listening, shared by every process; -1 to open in start()
+};
+
 // HTTP server class
 class HttpServer {
 private:
-    int server_fd;
-    int port;
+    static constexpr int kReadTimeoutSeconds = 30;  // also the longest wait for an in-flight prefetch
+
+    struct Listener {
+        std::string spec;
+        bool tls;
+        int fd;
+        bool shared;  // inherited and listened on by every process
+        std::thread thread;
+    };
+
+    std::vector<Listener> listeners;
+    int stop_pipe[2];  // readable once stop() begins, for accept loops on shared listeners
+    TlsContext* tls_context;
     bool running;
-    std::thread server_thread;
     ThreadSafeQueue<std::function<void()>> task_queue;
     std::vector<std::thread> worker_threads;
-    std::string apiKey;
-
-    // Function to parse HTTP request
-    HttpRequest parseRequest(const std::string& request_str) {
+    std::mutex workers_mutex;
+    size_t active_workers;
+    std::vector<std::thread::id> retired_workers;  // exited, not yet joined
+    std::mutex retired_mutex;
+    std::atomic<uint64_t> key_cursor;
+    SharedState& shared;
+    UsageStats& usage_stats;
+    StructuredOutputStats& structured_stats;
+    size_t shard;
+    size_t shards;
+    const PromptTemplateRegistry& templates;
+    const ConfigStore& config;
+    Tracer& tracer;
+    TransitionModel transitions;
+    SpeculationCache speculation;
+    std::atomic<size_t> busy_workers;
+    size_t speculative_inflight;
+    std::mutex speculation_mutex;
+    std::condition_variable speculation_done;
+    size_t batch_inflight;  // batch items running upstream, across all batch requests
+    std::mutex batch_mutex;
+    std::condition_variable batch_slot_free;
+
+    // Function to parse the request line and headers of an HTTP request
+    HttpRequest parseRequest(const std::string& head) {
         HttpRequest req;
-        std::istringstream stream(request_str);
+        std::istringstream stream(head);
         std::string line;
 
         // Parse request line
@@ -225,63 +596,172 @@ private:
             }
         }
 
-        // Parse body if Content-Length is present
-        if (req.headers.find("Content-Length") != req.headers.end()) {
-            int content_length = std::stoi(req.headers["Content-Length"]);
-            char* body_buffer = new char[content_length + 1];
-            stream.read(body_buffer, content_length);
-            body_buffer[content_length] = '\0';
-            req.body = body_buffer;
-            delete[] body_buffer;
-        }
-
         return req;
     }
 
-    // Function to serialize HTTP response
-    std::string serializeResponse(const HttpResponse& res) {
-        std::ostringstream stream;
-        stream << "HTTP/1.1 " << res.status_code << " ";
+    // Value of a Content-Length header: decimal digits only, without sign or
+    // overflow. An absent header is a length of 0.
+    static bool parseContentLength(const std::string& head, uint64_t& length) {
+        length = 0;
+        std::istringstream stream(head);
+        std::string line;
+        std::getline(stream, line);
+        while (std::getline(stream, line) && line != "\r") {
+            size_t pos = line.find(':');
+            if (pos != 14 || strncasecmp(line.c_str(), "Content-Length", 14) != 0) {
+                continue;
+            }
+            size_t first = line.find_first_not_of(" \t", pos + 1);
+            size_t last = line.find_last_not_of(" \t\r");
+            if (first == std::string::npos || last < first) {
+                return false;
+            }
+            std::string value = line.substr(first, last - first + 1);
+            if (value.find_first_not_of("0123456789") != std::string::npos || value.size() > 19) {
+                return false;
+            }
+            errno = 0;
+            length = std::strtoull(value.c_str(), nullptr, 10);
+            return errno == 0;
+        }
+        return true;
+    }
+
+    // Function to read a complete request: the head up to the blank line, then
+    // exactly Content-Length bytes of body. Returns 0 if the client sent
+    // nothing, 200 once `head` and `body` hold the request, or else the status
+    // to reject it with, with `error` saying why.
+    int readRequest(Connection& conn, std::string& head, std::string& body, std::string& error) {
+        size_t max_request_bytes = config.snapshot()->max_request_bytes;
+        char buffer[4096];
+        size_t header_end = std::string::npos;
+
+        while (header_end == std::string::npos) {
+            ssize_t bytes_read = conn.read(buffer, sizeof(buffer));
+            if (bytes_read <= 0) {
+                if (head.empty()) {
+                    return 0;
+                }
+                error = "Incomplete request headers";
+                return 400;
+            }
+            head.append(buffer, bytes_read);
+            header_end = head.find("\r\n\r\n");
+            if (header_end == std::string::npos && head.size() > max_request_bytes) {
+                error = "Request headers exceed max_request_bytes";
+                return 413;
+            }
+        }
+
+        // Bytes past the blank line are the start of the body
+        body = head.substr(header_end + 4);
+        head.resize(header_end + 4);
 
-        // Status text
-        switch (res.status_code) {
-            case 200: stream << "OK"; break;
-            case 404: stream << "Not Found"; break;
-            case 500: stream << "Internal Server Error"; break;
-            default: stream << "Unknown"; break;
+        uint64_t content_length;
+        if (!parseContentLength(head, content_length)) {
+            error = "Invalid Content-Length";
+            return 400;
+        }
+        if (content_length > max_request_bytes) {
+            error = "Request body of " + std::to_string(content_length) +
+                    " bytes exceeds max_request_bytes (" + std::to_string(max_request_bytes) + ")";
+            return 413;
         }
-        stream << "\r\n";
 
-        // Headers
-        for (const auto& header : res.headers) {
-            stream << header.first << ": " << header.second << "\r\n";
+        while (body.size() < content_length) {
+            ssize_t bytes_read = conn.read(buffer, std::min<size_t>(sizeof(buffer), content_length - body.size()));
+            if (bytes_read <= 0) {
+                error = "Request body shorter than Content-Length";
+                return 400;
+            }
+            body.append(buffer, bytes_read);
         }
+        // Anything after the declared body belongs to no request; the
+        // connection is closed after the response
+        body.resize(content_length);
+        return 200;
+    }
+
+    // Function to handle client connection
+    void handleClient(int client_fd, TlsContext* tls, uint64_t accepted_ns) {
+        uint64_t dequeued_ns = Tracer::now();
+        Connection conn(client_fd);
 
-        // Content-Length header
-        stream << "Content-Length: " << res.body.length() << "\r\n";
+        // Bound how long a stalled client can hold a worker in a blocking read
+        struct timeval timeout = {kReadTimeoutSeconds, 0};
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-        // End of headers
-        stream << "\r\n";
+        if (tls && !conn.startTls(tls)) {
+            return;
+        }
+        uint64_t ready_ns = Tracer::now();
+
+#ifdef CEREBRAS_HAVE_NGHTTP2
+        if (conn.applicationProtocol() == "h2") {
+            Http2Session session(conn, [this](const HttpRequest& req, ResponseStream& out) {
+                RequestTrace trace(tracer, header(req, "traceparent"), routeName(req), Tracer::now());
+                handleRequest(req, out, trace);
+            }, std::chrono::seconds(kReadTimeoutSeconds), config.snapshot()->max_request_bytes);
+            session.run();
+            return;
+        }
+#endif
 
-        // Body
-        stream << res.body;
+        std::string head, body, error;
+        int status = readRequest(conn, head, body, error);
+        uint64_t read_ns = Tracer::now();
+        if (status == 0) {
+            return;
+        }
+        HttpRequest req = parseRequest(head);
+        req.body = std::move(body);
+        req.remote_addr = conn.peerAddress();
+
+        // The trace starts at accept, so time spent queued for a worker is visible
+        RequestTrace trace(tracer, header(req, "traceparent"), routeName(req), accepted_ns);
+        trace.child("queue", accepted_ns, dequeued_ns);
+        if (tls) {
+            trace.child("tls.handshake", dequeued_ns, ready_ns);
+        }
+        trace.child("read", ready_ns, read_ns);
+        trace.child("parse", read_ns, Tracer::now());
 
-        return stream.str();
+        Http1ResponseStream out(conn);
+        if (status != 200) {
+            trace.setStatus(status);
+            out.send(errorResponse(status, error));
+            return;
+        }
+        handleRequest(req, out, trace);
     }
 
-    // Function to handle client connection
-    void handleClient(int client_fd) {
-        char buffer[4096] = {0};
-        ssize_t bytes_read = read(client_fd, buffer, 4096);
+    static std::string header(const HttpRequest& req, const std::string& name) {
+        auto it = req.headers.find(name);
+        return it == req.headers.end() ? "" : it->second;
+    }
 
-        if (bytes_read > 0) {
-            HttpRequest req = parseRequest(buffer);
-            HttpResponse res = routeRequest(req);
-            std::string response_str = serializeResponse(res);
-            write(client_fd, response_str.c_str(), response_str.length());
+    // Span names must outlive the request, so routes map to fixed strings
+    static const char* routeName(const HttpRequest& req) {
+        if (req.method == "POST") {
+            if (req.path == "/api/chat") return "POST /api/chat";
+            if (req.path == "/api/chat/batch") return "POST /api/chat/batch";
+            return "POST";
         }
+        if (req.path == "/api/stats") return "GET /api/stats";
+        if (req.path == "/api/templates") return "GET /api/templates";
+        return "GET";
+    }
 
-        close(client_fd);
+    // Function to answer one request on any transport
+    void handleRequest(const HttpRequest& req, ResponseStream& out, Span& trace) {
+        if (req.method == "POST" && req.path == "/api/chat/batch") {
+            trace.setStatus(handleBatchRequest(req, out));
+        } else {
+            HttpResponse res = routeRequest(req);
+            trace.setStatus(res.status_code);
+            Span write("write");
+            out.send(res);
+        }
     }
 
     // Function to route request to appropriate handler
@@ -296,6 +776,10 @@ private:
                 return serveFile("script.js", "text/javascript");
             } else if (req.path == "/legal.html") {
                 return serveFile("legal.html", "text/html");
+            } else if (req.path == "/api/stats") {
+                return handleStatsRequest();
+            } else if (req.path == "/api/templates") {
+                return handleTemplatesRequest();
             }
         }
 
@@ -332,25 +816,253 @@ private:
         return res;
     }
 
+    // Clients may label themselves; otherwise usage is attributed to the peer
+    // address. The label is only for /api/stats: rate limits always key on the
+    // peer address, so changing it does not reset a client's bucket. Labels are cut to 63 characters of [A-Za-z0-9._:@-], with
+    // anything else replaced by '_', so they stay readable in /api/stats.
+    static std::string clientId(const HttpRequest& req) {
+        auto client_header = req.headers.find("X-Client-Id");
+        if (client_header == req.headers.end() || client_header->second.empty()) {
+            return req.remote_addr;
+        }
+        std::string id = client_header->second.substr(0, 63);
+        for (char& c : id) {
+            if (!std::isalnum(static_cast<unsigned char>(c)) && std::string("._:@-").find(c) == std::string::npos) {
+                c = '_';
+            }
+        }
+        return id;
+    }
+
     // Function to handle chat API request
     HttpResponse handleChatRequest(const HttpRequest& req) {
+        Span parse("request.json");
+        json request_data = json::parse(req.body, nullptr, false);
+        parse.end();
+        if (request_data.is_discarded()) {
+            usage_stats.record("unknown", clientId(req), UsageSample(), 0, false);
+            return errorResponse(500, "Invalid JSON request body");
+        }
+        return runChat(request_data, clientId(req), req.remote_addr);
+    }
+
+    // Rotate through the configured API keys, one per upstream request
+    std::string nextApiKey(const ServerConfig& cfg) {
+        if (cfg.api_keys.empty()) {
+            return "";
+        }
+        return cfg.api_keys[key_cursor.fetch_add(1, std::memory_order_relaxed) % cfg.api_keys.size()];
+    }
+
+    // Identity of a chat request as sent upstream, with config defaults applied
+    static std::string requestKey(const json& request_data, const ServerConfig& cfg) {
+        return json{
+            {"model", request_data.value("model", cfg.default_model)},
+            {"system_prompt", request_data.value("system_prompt", "")},
+            {"template", request_data.value("system_template", "")},
+            {"vars", request_data.value("template_vars", json::object())},
+            {"user_prompt", request_data.value("user_prompt", "")},
+            {"temperature", request_data.value("temperature", cfg.temperature)},
+            {"top_p", request_data.value("top_p", cfg.top_p)},
+            {"max_tokens", request_data.value("max_tokens", cfg.max_tokens)},
+            {"tools", request_data.value("tools", json())},
+            {"tool_choice", request_data.value("tool_choice", json())},
+            {"response_format", request_data.value("response_format", json())}
+        }.dump();
+    }
+
+    // The speculation cache and transition model are per process, while the
+    // kernel spreads a client's follow-ups over every process, so with more
+    // than one process most prefetches would go unused
+    bool speculationAvailable(const ServerConfig& cfg) const {
+        return cfg.speculation_enabled && shards == 1;
+    }
+
+    // Learn from a finished template request, then fetch its predicted
+    // follow-up (the same input with the next template) into the speculation
+    // cache, but only while workers are idle and the token budget allows
+    void prefetchNext(const ServerConfig& cfg, const json& request_data, const std::string& client_id) {
+        std::string template_id = request_data.at("system_template");
+        if (cfg.speculation_learn) {
+            transitions.observe(client_id, template_id, request_data.value("user_prompt", "") + '\0' +
+                                request_data.value("template_vars", json::object()).dump());
+        }
+        std::string next = transitions.predict(template_id, cfg.speculation_sequences, cfg.speculation_learn,
+                                               cfg.speculation_min_confidence, cfg.speculation_min_observations);
+        if (next.empty() || !templates.find(next)) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(speculation_mutex);
+            if (!task_queue.empty() || busy_workers.load(std::memory_order_relaxed) >= cfg.workers ||
+                speculative_inflight >= cfg.speculation_max_inflight) {
+                speculation.skippedBusy();
+                return;
+            }
+            speculative_inflight++;
+        }
+
+        json next_request = request_data;
+        next_request["system_template"] = next;
+        std::string key = requestKey(next_request, cfg);
+        if (!speculation.reserve(key, cfg.speculation_tokens_per_minute)) {
+            std::lock_guard<std::mutex> lock(speculation_mutex);
+            speculative_inflight--;
+            return;
+        }
+
+        // Runs off the worker pool, like batch items; stop() waits for it
+        std::thread([this, next_request, key]() {
+            UsageSample usage;
+            HttpResponse res = runChat(next_request, "speculation", "", true, &usage);
+            speculation.complete(key, res.status_code == 200, res.body, usage.prompt_tokens + usage.completion_tokens);
+            std::lock_guard<std::mutex> lock(speculation_mutex);
+            speculative_inflight--;
+            speculation_done.notify_all();
+        }).detach();
+    }
+
+    // Function to run one chat completion for an /api/chat or batch item request.
+    // `client_id` labels usage stats and `rate_key` picks the rate limit bucket.
+    // Speculative runs skip the speculation cache and report their usage.
+    HttpResponse runChat(const json& request_data, const std::string& client_id, const std::string& rate_key,
+                         bool speculative = false, UsageSample* usage = nullptr) {
         HttpResponse res;
+        auto started = std::chrono::steady_clock::now();
+        std::shared_ptr<const ServerConfig> cfg = config.snapshot();
+        std::string model = "unknown";
 
         try {
-            json request_data = json::parse(req.body);
-            std::string model = request_data["model"];
-            std::string system_prompt = request_data["system_prompt"];
-            std::string user_prompt = request_data["user_prompt"];
+            model = request_data.value("model", cfg->default_model);
+            std::string user_prompt = request_data.at("user_prompt");
+            double temperature = request_data.value("temperature", cfg->temperature);
+            double top_p = request_data.value("top_p", cfg->top_p);
+            int max_tokens = request_data.value("max_tokens", cfg->max_tokens);
+
+            if (!cfg->modelAllowed(model)) {
+                usage_stats.record(model, client_id, UsageSample(), elapsedMicros(started), false);
+                return errorResponse(400, "Model not allowed: " + model);
+            }
+
+            // Every process draws from the same bucket for a peer address
+            if (!speculative && cfg->rate_limit_per_minute) {
+                uint64_t wait_ms = shared.rate_limits.acquire(rate_key, cfg->rate_limit_per_minute,
+                                                              cfg->rate_limit_burst);
+                if (wait_ms) {
+                    usage_stats.record(model, client_id, UsageSample(), elapsedMicros(started), false);
+                    res = errorResponse(429, "Rate limit exceeded");
+                    res.headers["Retry-After"] = std::to_string((wait_ms + 999) / 1000);
+                    return res;
+                }
+            }
+
+            std::string cache_key = cfg->cache_enabled && !speculative ? requestKey(request_data, *cfg) : "";
+            if (!cache_key.empty()) {
+                std::string cached;
+                if (shared.responses.get(cache_key, cached)) {
+                    // Counted as a request that used no upstream tokens
+                    usage_stats.record(model, client_id, UsageSample(), elapsedMicros(started), true);
+                    res.status_code = 200;
+                    res.headers["Content-Type"] = "application/json";
+                    res.headers["X-Cache"] = "hit";
+                    res.body = cached;
+                    return res;
+                }
+            }
+
+            bool prefetch = !speculative && speculationAvailable(*cfg) && request_data.contains("system_template");
+            if (prefetch) {
+                // Serve a response fetched ahead of time, waiting for it if it is still in flight
+                speculation.expire(std::chrono::seconds(cfg->speculation_ttl_seconds));
+                std::string cached;
+                if (speculation.take(requestKey(request_data, *cfg), cached,
+                                     std::chrono::seconds(kReadTimeoutSeconds))) {
+                    // The tokens were counted under "speculation" when it was fetched
+                    usage_stats.record(model, client_id, UsageSample(), elapsedMicros(started), true);
+                    res.status_code = 200;
+                    res.headers["Content-Type"] = "application/json";
+                    res.headers["X-Speculation"] = "hit";
+                    res.body = cached;
+                    prefetchNext(*cfg, request_data, client_id);
+                    return res;
+                }
+            }
+
+            // Tool definitions and JSON response formats are checked as the
+            // output streams in, unless validation is switched off
+            std::shared_ptr<const StructuredOutput> structured;
+            try {
+                structured = StructuredOutput::fromRequest(request_data);
+            } catch (const std::invalid_argument& e) {
+                usage_stats.record(model, client_id, UsageSample(), elapsedMicros(started), false);
+                return errorResponse(400, e.what());
+            }
+            std::unique_ptr<ChatStreamAssembler> assembler;
+            if (structured && structured->validates() && cfg->schema_validation != "off") {
+                assembler.reset(new ChatStreamAssembler(structured.get(), cfg->schema_validation == "incremental"));
+            }
+
+            CerebrasClient client(nextApiKey(*cfg), cfg->upstream_url);
+            std::string response;
+
+            // Clients may reference a registered system prompt by ID instead of sending its text
+            if (request_data.contains("system_template")) {
+                std::string template_id = request_data.at("system_template");
+                const PromptTemplate* system_template = templates.find(template_id);
+                if (!system_template) {
+                    throw std::runtime_error("Unknown system template: " + template_id);
+                }
+                std::map<std::string, std::string> vars =
+                    request_data.value("template_vars", std::map<std::string, std::string>());
+                response = client.chatCompletions(model, *system_template, vars, user_prompt,
+                                                  temperature, top_p, max_tokens, structured.get(), assembler.get());
+            } else {
+                std::string system_prompt = request_data.at("system_prompt");
+                response = client.chatCompletions(model, system_prompt, user_prompt,
+                                                  temperature, top_p, max_tokens, structured.get(), assembler.get());
+            }
 
-            CerebrasClient client(apiKey);
-            std::string response = client.chatCompletions(model, system_prompt, user_prompt);
+            if (assembler) {
+                assembler->finish();
+                structured_stats.record(*assembler);
+                if (assembler->failed()) {
+                    usage_stats.record(model, client_id, UsageSample(), elapsedMicros(started), false);
+                    res.status_code = 502;
+                    res.headers["Content-Type"] = "application/json";
+                    res.body = json{
+                        {"error", "Model output violates the requested schema: " + assembler->violation()},
+                        {"violation", assembler->violationJson()}
+                    }.dump();
+                    return res;
+                }
+                if (!assembler->eventStream()) {
+                    // An upstream error arrives as a plain JSON body
+                    response = assembler->rawBody();
+                }
+            }
 
             // Parse the response and extract only the final content
-            json response_json = json::parse(response);
-            if (response_json.contains("choices") &&
+            Span reparse("response.json");
+            json response_json = assembler && assembler->eventStream() ? assembler->completion() : json::parse(response);
+            UsageSample sample = extractUsage(response_json);
+            bool ok = !response_json.contains("error");
+            usage_stats.record(model, client_id, sample, elapsedMicros(started), ok);
+            if (usage) {
+                *usage = sample;
+            }
+            if (speculative && !ok) {
+                // Never cache an upstream error for a request nobody has made yet
+                return errorResponse(502, "Upstream error");
+            }
+            // Content that must be JSON is passed through untouched
+            bool json_content = structured && structured->contentSchema();
+            if (!json_content &&
+                response_json.contains("choices") &&
                 response_json["choices"].size() > 0 &&
                 response_json["choices"][0].contains("message") &&
-                response_json["choices"][0]["message"].contains("content")) {
+                response_json["choices"][0]["message"].contains("content") &&
+                response_json["choices"][0]["message"]["content"].is_string()) {
 
                 std::string content = response_json["choices"][0]["message"]["content"];
                 // Extract only the final response after the last "Let me"
@@ -362,91 +1074,274 @@ private:
                     }
                 }
                 response_json["choices"][0]["message"]["content"] = content;
-                response = response_json.dump();
             }
+            response = response_json.dump();
 
             res.status_code = 200;
             res.headers["Content-Type"] = "application/json";
             res.body = response;
+            if (!cache_key.empty() && ok) {
+                shared.responses.put(cache_key, response, cfg->cache_ttl_seconds * 1000);
+            }
+            if (prefetch && ok) {
+                prefetchNext(*cfg, request_data, client_id);
+            }
         } catch (const std::exception& e) {
-            res.status_code = 500;
-            res.headers["Content-Type"] = "application/json";
-            json error = {{"error", e.what()}};
-            res.body = error.dump();
+            usage_stats.record(model, client_id, UsageSample(), elapsedMicros(started), false);
+            res = errorResponse(500, e.what());
         }
 
         return res;
     }
 
-    // Server main loop
-    void serverLoop() {
-        struct sockaddr_in address;
-        int addrlen = sizeof(address);
+    // Batch items from every batch request share limits.max_batch_inflight
+    // upstream calls, so concurrent batches queue instead of multiplying
+    void acquireBatchSlot() {
+        std::unique_lock<std::mutex> lock(batch_mutex);
+        batch_slot_free.wait(lock, [this]() { return batch_inflight < config.snapshot()->max_batch_inflight; });
+        batch_inflight++;
+    }
+
+    void releaseBatchSlot() {
+        std::lock_guard<std::mutex> lock(batch_mutex);
+        batch_inflight--;
+        batch_slot_free.notify_one();
+    }
 
-        // Create socket file descriptor
-        if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-            std::cerr << "Socket failed" << std::endl;
-            return;
+    // Function to fan a batch of chat requests out to the upstream concurrently.
+    // The body is an array of /api/chat requests, or {"requests": [...],
+    // "concurrency": N}. Results are streamed back as NDJSON in completion
+    // order, one {"index", "status", "latency_ms", "response"} object per line.
+    int handleBatchRequest(const HttpRequest& req, ResponseStream& out) {
+        std::shared_ptr<const ServerConfig> cfg = config.snapshot();
+        json batch = json::parse(req.body, nullptr, false);
+        json items = batch.is_object() ? batch.value("requests", json()) : batch;
+        if (!items.is_array() || items.empty() || items.size() > cfg->max_batch_size) {
+            out.send(errorResponse(400,
+                "Batch body must be a non-empty array of at most " + std::to_string(cfg->max_batch_size) + " requests"));
+            return 400;
         }
 
-        // Set socket options
-        int opt = 1;
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-            std::cerr << "Setsockopt failed" << std::endl;
-            return;
+        size_t concurrency = cfg->batch_concurrency;
+        if (batch.is_object() && batch.contains("concurrency") && batch["concurrency"].is_number_unsigned()) {
+            concurrency = batch["concurrency"];
+        }
+        concurrency = std::max<size_t>(1, std::min({concurrency, cfg->max_batch_concurrency, items.size()}));
+
+        bool connected = out.begin(200, {{"Content-Type", "application/x-ndjson"}, {"Cache-Control", "no-store"}});
+
+        // Batch items run on their own threads so they never wait behind, or
+        // starve, the worker pool that serves ordinary connections
+        std::string client_id = clientId(req);
+        TraceHandle trace = Tracer::current();
+        ThreadSafeQueue<std::string> results;
+        std::atomic<size_t> next{0};
+        std::vector<std::thread> runners;
+        for (size_t i = 0; i < concurrency; i++) {
+            runners.emplace_back([&]() {
+                size_t index;
+                while ((index = next.fetch_add(1)) < items.size()) {
+                    auto started = std::chrono::steady_clock::now();
+                    Span span(trace, "batch.item");
+                    HttpResponse item;
+                    if (!items[index].is_object()) {
+                        item = errorResponse(400, "Batch item must be a JSON object");
+                    } else {
+                        acquireBatchSlot();
+                        item = runChat(items[index], client_id, req.remote_addr);
+                        releaseBatchSlot();
+                    }
+                    span.setStatus(item.status_code);
+                    span.end();
+                    std::ostringstream line;
+                    line << "{\"index\":" << index
+                         << ",\"status\":" << item.status_code
+                         << ",\"latency_ms\":" << elapsedMicros(started) / 1e3
+                         << ",\"response\":" << item.body << "}\n";
+                    results.push(line.str());
+                }
+            });
         }
 
-        // Bind socket to port
-        address.sin_family = AF_INET;
-        address.sin_addr.s_addr = INADDR_ANY;
-        address.sin_port = htons(port);
+        // Keep draining after a disconnect so the runners can finish
+        for (size_t i = 0; i < items.size(); i++) {
+            std::string line = results.pop();
+            if (connected) {
+                connected = out.write(line);
+            }
+        }
+        if (connected) {
+            out.end();
+        }
 
-        if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-            std::cerr << "Bind failed" << std::endl;
-            return;
+        for (auto& runner : runners) {
+            runner.join();
         }
+        return 200;
+    }
 
-        // Listen for connections
-        if (listen(server_fd, 10) < 0) {
-            std::cerr << "Listen failed" << std::endl;
-            return;
+    static HttpResponse errorResponse(int status_code, const std::string& message) {
+        HttpResponse res;
+        res.status_code = status_code;
+        res.headers["Content-Type"] = "application/json";
+        json error = {{"error", message}};
+        res.body = error.dump();
+        return res;
+    }
+
+    // Function to report aggregated token usage and throughput
+    HttpResponse handleStatsRequest() {
+        HttpResponse res;
+        res.status_code = 200;
+        res.headers["Content-Type"] = "application/json";
+        res.headers["Cache-Control"] = "no-store";
+        json stats = usage_stats.toJson();
+        stats["tracing"] = tracer.toJson();
+        stats["speculation"] = speculation.toJson();
+        stats["speculation"]["enabled"] = speculationAvailable(*config.snapshot());
+        stats["speculation"]["transitions"] = transitions.toJson();
+        stats["structured_output"] = structured_stats.toJson();
+        stats["structured_output"]["validation"] = config.snapshot()->schema_validation;
+        stats["response_cache"] = shared.responses.toJson();
+        stats["response_cache"]["enabled"] = config.snapshot()->cache_enabled;
+        stats["rate_limit"] = shared.rate_limits.toJson();
+        stats["rate_limit"]["requests_per_minute"] = config.snapshot()->rate_limit_per_minute;
+        // Usage, structured_output, response_cache and rate_limit cover every
+        // process; tracing, speculation and tls are this process's own
+        stats["process"] = {{"shard", shard}, {"processes", shards}, {"pid", getpid()}};
+#ifdef CEREBRAS_HAVE_OPENSSL
+        if (tls_context) {
+            stats["tls"] = {
+                {"handshakes", tls_context->handshakes.load(std::memory_order_relaxed)},
+                {"resumed", tls_context->resumed.load(std::memory_order_relaxed)},
+                {"failed", tls_context->failed.load(std::memory_order_relaxed)}
+            };
         }
+#endif
+        res.body = stats.dump();
+        return res;
+    }
+
+    // Function to list the registered system prompt templates
+    HttpResponse handleTemplatesRequest() {
+        HttpResponse res;
+        res.status_code = 200;
+        res.headers["Content-Type"] = "application/json";
+        res.body = templates.toJson().dump();
+        return res;
+    }
+
+    static uint64_t elapsedMicros(std::chrono::steady_clock::time_point since) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - since).count();
+    }
 
-        std::cout << "Server listening on port " << port << std::endl;
+    // Accept loop for one listener
+    void acceptLoop(Listener& listener) {
+        std::cout << "Server listening on " << listener.spec << (listener.tls ? " (TLS)" : "") << std::endl;
 
         // Accept connections
         while (running) {
+            // A shared listener is non-blocking and must not be shut down, as
+            // that would stop it for every process, so wait in poll() where
+            // stop() can wake us. Another process may win the connection.
+            if (listener.shared) {
+                struct pollfd fds[2] = {{listener.fd, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+                if (poll(fds, 2, -1) < 0 || fds[1].revents) {
+                    if (!running) break;
+                    continue;
+                }
+            }
             int new_socket;
-            if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
+            if ((new_socket = accept(listener.fd, nullptr, nullptr)) < 0) {
                 if (!running) break;
+                if (listener.shared && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
                 std::cerr << "Accept failed" << std::endl;
                 continue;
             }
 
             // Add client handling task to queue
-            task_queue.push([this, new_socket]() {
-                handleClient(new_socket);
+            TlsContext* tls = listener.tls ? tls_context : nullptr;
+            uint64_t accepted_ns = Tracer::now();
+            task_queue.push([this, new_socket, tls, accepted_ns]() {
+                handleClient(new_socket, tls, accepted_ns);
             });
         }
     }
 
+    // Set by a retire task to make the worker that runs it exit its loop
+    static bool& workerRetiring() {
+        thread_local bool retiring = false;
+        return retiring;
+    }
+
     // Worker thread function
     void workerLoop() {
-        while (running) {
+        while (running && !workerRetiring()) {
             auto task = task_queue.pop();
+            busy_workers.fetch_add(1, std::memory_order_relaxed);
             task();
+            busy_workers.fetch_sub(1, std::memory_order_relaxed);
+        }
+        if (workerRetiring()) {
+            std::lock_guard<std::mutex> lock(retired_mutex);
+            retired_workers.push_back(std::this_thread::get_id());
         }
     }
 
 public:
-    HttpServer(int port = 8080) : port(port), running(false) {
-        // Load API key from environment
-        const char* apiKeyEnv = std::getenv("CEREBRAS_API_KEY");
-        if (!apiKeyEnv) {
+    // `shard` of `shards` processes; with more than one, TCP listeners are
+    // opened with SO_REUSEPORT so the kernel spreads connections over them
+    HttpServer(const PromptTemplateRegistry& templates, const ConfigStore& config, Tracer& tracer,
+               SharedState& shared, const std::vector<ListenerSpec>& specs, TlsContext* tls_context = nullptr,
+               size_t shard = 0, size_t shards = 1)
+        : tls_context(tls_context), running(false), active_workers(0), key_cursor(0),
+          shared(shared), usage_stats(shared.usage), structured_stats(shared.structured), shard(shard), shards(shards),
+          templates(templates), config(config), tracer(tracer), busy_workers(0), speculative_inflight(0), batch_inflight(0) {
+        for (const auto& spec : specs) {
+            if (spec.tls && !tls_context) {
+                throw std::runtime_error("TLS listener " + spec.spec + " needs --tls-cert and --tls-key");
+            }
+            listeners.push_back({spec.spec, spec.tls, spec.fd, spec.fd >= 0, std::thread()});
+        }
+        if (config.snapshot()->api_keys.empty()) {
             std::cerr << "Warning: CEREBRAS_API_KEY environment variable not set" << std::endl;
-            apiKey = "";
-        } else {
-            apiKey = apiKeyEnv;
+        }
+    }
+
+    // Wake batch items queued on limits.max_batch_inflight after a reload,
+    // which may have raised the limit
+    void batchLimitChanged() {
+        std::lock_guard<std::mutex> lock(batch_mutex);
+        batch_slot_free.notify_all();
+    }
+
+    // Grow or shrink the worker pool to `count` threads. Surplus workers exit
+    // after finishing their current task; the threads of workers that have
+    // exited since the last resize are joined here, the rest in stop().
+    void resizeWorkers(size_t count) {
+        std::lock_guard<std::mutex> lock(workers_mutex);
+        if (!running) return;
+
+        std::vector<std::thread::id> exited;
+        {
+            std::lock_guard<std::mutex> retired_lock(retired_mutex);
+            exited.swap(retired_workers);
+        }
+        for (const std::thread::id& id : exited) {
+            auto it = std::find_if(worker_threads.begin(), worker_threads.end(),
+                                   [&](const std::thread& thread) { return thread.get_id() == id; });
+            if (it != worker_threads.end()) {
+                it->join();
+                worker_threads.erase(it);
+            }
+        }
+
+        for (; active_workers < count; active_workers++) {
+            worker_threads.emplace_back(&HttpServer::workerLoop, this);
+        }
+        for (; active_workers > count; active_workers--) {
+            task_queue.push([]() { workerRetiring() = true; });
         }
     }
 
@@ -457,15 +1352,25 @@ public:
     void start() {
         if (running) return;
 
+        // Bind every listener before starting anything, so a bad address fails fast
+        for (auto& listener : listeners) {
+            if (listener.fd < 0) {
+                listener.fd = openListener(listener.spec, 128, shards > 1);
+            }
+        }
+
+        if (pipe(stop_pipe) < 0) {
+            throw std::runtime_error("pipe() failed");
+        }
         running = true;
 
         // Start worker threads
-        for (int i = 0; i < 4; i++) {
-            worker_threads.emplace_back(&HttpServer::workerLoop, this);
-        }
+        resizeWorkers(config.snapshot()->workers);
 
-        // Start server thread
-        server_thread = std::thread(&HttpServer::serverLoop, this);
+        // Start one accept thread per listener
+        for (auto& listener : listeners) {
+            listener.thread = std::thread(&HttpServer::acceptLoop, this, std::ref(listener));
+        }
 
         std::cout << "Server started" << std::endl;
     }
@@ -475,16 +1380,28 @@ public:
 
         running = false;
 
-        // Close server socket to unblock accept
-        close(server_fd);
-
-        // Wait for server thread to finish
-        if (server_thread.joinable()) {
-            server_thread.join();
+        // Shut down and close listening sockets to unblock accept
+        if (write(stop_pipe[1], "", 1) < 0) {
+            std::cerr << "Failed to wake accept loops" << std::endl;
+        }
+        for (auto& listener : listeners) {
+            if (!listener.shared) {
+                shutdown(listener.fd, SHUT_RDWR);
+            }
+            close(listener.fd);
+            if (!listener.shared) {
+                removeListenerSocket(listener.spec);
+            }
+            if (listener.thread.joinable()) {
+                listener.thread.join();
+            }
         }
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
 
         // Add empty tasks to unblock worker threads
-        for (size_t i = 0; i < worker_threads.size(); i++) {
+        std::lock_guard<std::mutex> lock(workers_mutex);
+        for (size_t i = 0; i < active_workers; i++) {
             task_queue.push([](){});
         }
 
@@ -496,6 +1413,12 @@ public:
         }
 
         worker_threads.clear();
+        retired_workers.clear();
+        active_workers = 0;
+
+        // Speculative requests run on their own threads and must finish before the server goes away
+        std::unique_lock<std::mutex> speculation_lock(speculation_mutex);
+        speculation_done.wait(speculation_lock, [this]() { return speculative_inflight == 0; });
 
         std::cout << "Server stopped" << std::endl;
     }
@@ -507,27 +1430,195 @@ int main(int argc, char* argv[]) {
 
     // Parse command line arguments
     int port = 8080;
+    std::vector<std::string> templateFiles;
+    std::string configFile;
+    std::vector<ListenerSpec> listenerSpecs;
+    bool plainListener = false;
+    std::string tlsCert;
+    std::string tlsKey;
+    std::string traceMode;
+    std::string traceExport = "cerebras_traces.jsonl";
+    bool speculate = false;
+    size_t processes = 1;
+    std::string pin = "cpu";
     for (int i = 1; i < argc; i++) {
         std::string arg = argv[i];
         if (arg == "--port" && i + 1 < argc) {
             port = std::stoi(argv[++i]);
+        } else if (arg == "--templates" && i + 1 < argc) {
+            templateFiles.push_back(argv[++i]);
+        } else if (arg == "--config" && i + 1 < argc) {
+            configFile = argv[++i];
+        } else if (arg == "--listen" && i + 1 < argc) {
+            listenerSpecs.push_back({argv[++i], false});
+            plainListener = true;
+        } else if (arg == "--tls-listen" && i + 1 < argc) {
+            listenerSpecs.push_back({argv[++i], true});
+        } else if (arg == "--tls-cert" && i + 1 < argc) {
+            tlsCert = argv[++i];
+        } else if (arg == "--tls-key" && i + 1 < argc) {
+            tlsKey = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            traceMode = argv[++i];
+        } else if (arg == "--trace-export" && i + 1 < argc) {
+            traceExport = argv[++i];
+        } else if (arg == "--speculate") {
+            speculate = true;
+        } else if (arg == "--processes" && i + 1 < argc) {
+            processes = std::stoul(argv[++i]);
+        } else if (arg == "--pin" && i + 1 < argc) {
+            pin = argv[++i];
         } else if (arg == "--help") {
             std::cout << "Usage: " << argv[0] << " [options]" << std::endl;
             std::cout << "Options:" << std::endl;
             std::cout << "  --port PORT             Specify the port to listen on (default: 8080)" << std::endl;
+            std::cout << "  --templates FILE        Load system prompt templates from a markdown file" << std::endl;
+            std::cout << "                          (repeatable; default: the bundled *_prompts.md files)" << std::endl;
+            std::cout << "  --config FILE           Load settings from a JSON file, reloaded when it changes" << std::endl;
+            std::cout << "  --listen ADDR           Plain HTTP listener: HOST:PORT, [IPV6]:PORT or unix:PATH" << std::endl;
+            std::cout << "                          (repeatable; replaces the default 0.0.0.0:PORT)" << std::endl;
+            std::cout << "  --tls-listen ADDR       TLS listener with HTTP/2 via ALPN when built with nghttp2" << std::endl;
+            std::cout << "  --tls-cert FILE         PEM certificate chain for TLS listeners" << std::endl;
+            std::cout << "  --tls-key FILE          PEM private key for TLS listeners" << std::endl;
+            std::cout << "  --trace MODE            Request tracing: off, sample (keep slow/failed) or always" << std::endl;
+            std::cout << "  --trace-export DEST     OTLP/JSON file or http(s):// collector URL for kept traces" << std::endl;
+            std::cout << "                          (default: cerebras_traces.jsonl)" << std::endl;
+            std::cout << "  --speculate             Prefetch predicted follow-up template requests while idle" << std::endl;
+            std::cout << "  --processes N           Serve from N processes sharing the port, cache, rate limits" << std::endl;
+            std::cout << "                          and stats (default: 1)" << std::endl;
+            std::cout << "  --pin MODE              CPU placement with --processes: cpu (a disjoint slice of a" << std::endl;
+            std::cout << "                          NUMA node each), node (a whole node each) or none (default: cpu)" << std::endl;
             std::cout << "  --help                  Show this help message" << std::endl;
             return 0;
         }
     }
 
+    if (processes == 0 || processes > 256) {
+        std::cerr << "Error: --processes must be between 1 and 256" << std::endl;
+        return 1;
+    }
+    if (pin != "cpu" && pin != "node" && pin != "none") {
+        std::cerr << "Error: --pin must be cpu, node or none" << std::endl;
+        return 1;
+    }
+
+    if (templateFiles.empty()) {
+        templateFiles = {"hardware_system_prompts.md", "ml_optimization_prompts.md",
+                         "diagnostic_troubleshooting_prompts.md"};
+    }
+
+    // Templates are immutable once the server starts, so workers share them without locking
+    PromptTemplateRegistry templates;
+    for (const auto& file : templateFiles) {
+        templates.loadMarkdown(file);
+    }
+    std::cout << "Loaded " << templates.count() << " prompt templates" << std::endl;
+
+    if (!plainListener) {
+        listenerSpecs.insert(listenerSpecs.begin(), {"0.0.0.0:" + std::to_string(port), false});
+    }
+
+    // A client that disconnects mid-response must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
     try {
-        HttpServer server(port);
-        server.start();
+        std::unique_ptr<TlsContext> tls;
+        if (!tlsCert.empty() || !tlsKey.empty()) {
+#ifdef CEREBRAS_HAVE_OPENSSL
+            tls.reset(new TlsContext(tlsCert, tlsKey));
+#else
+            throw std::runtime_error("TLS support was not built in (OpenSSL not found)");
+#endif
+        }
 
-        std::cout << "Press Enter to stop the server..." << std::endl;
-        std::cin.get();
+        // Settings from the environment, overlaid by the config file if one is given
+        ServerConfig base = ServerConfig::fromEnvironment();
+        if (!traceMode.empty()) {
+            base = ServerConfig::fromJson({{"tracing", {{"mode", traceMode}}}}, base);
+        }
+        if (speculate) {
+            base = ServerConfig::fromJson({{"speculation", {{"enabled", true}}}}, base);
+        }
+        ConfigStore config(configFile.empty() ? base : ServerConfig::fromFile(configFile, base));
+
+        SharedMapping<SharedState> shared;
+
+        // One server process: tracing, the HTTP server and config reloads,
+        // running until `waitForStop` returns
+        auto serve = [&](size_t shard, const std::function<void()>& waitForStop) {
+            Tracer tracer;
+            auto configureTracer = [&tracer](const ServerConfig& cfg) {
+                tracer.configure(Tracer::parseMode(cfg.trace_mode), cfg.trace_slow_ms, cfg.trace_sample_ratio);
+            };
+            configureTracer(*config.snapshot());
+            // Each process appends to a trace file of its own, e.g. cerebras_traces.2.jsonl
+            std::string exportTo = traceExport;
+            if (processes > 1 && exportTo.find("://") == std::string::npos) {
+                size_t dot = exportTo.rfind('.');
+                size_t slash = exportTo.rfind('/');
+                if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+                    dot = exportTo.size();
+                }
+                exportTo.insert(dot, "." + std::to_string(shard));
+            }
+            tracer.startExporter(exportTo);
+
+            HttpServer server(templates, config, tracer, *shared, listenerSpecs, tls.get(), shard, processes);
+            server.start();
+
+            std::unique_ptr<ConfigWatcher> watcher;
+            if (!configFile.empty()) {
+                watcher.reset(new ConfigWatcher(configFile, base, config, [&](const ServerConfig& cfg) {
+                    server.resizeWorkers(cfg.workers);
+                    server.batchLimitChanged();
+                    configureTracer(cfg);
+                }));
+            }
+
+            waitForStop();
+
+            watcher.reset();
+            server.stop();
+            tracer.stopExporter();
+        };
+
+        if (processes == 1) {
+            serve(0, []() {
+                std::cout << "Press Enter to stop the server..." << std::endl;
+                std::cin.get();
+            });
+            return 0;
+        }
 
-        server.stop();
+        // SO_REUSEPORT only covers TCP, so unix sockets are bound once here and inherited
+        for (auto& spec : listenerSpecs) {
+            if (spec.spec.compare(0, 5, "unix:") == 0) {
+                spec.fd = openListener(spec.spec);
+                fcntl(spec.fd, F_SETFL, fcntl(spec.fd, F_GETFL) | O_NONBLOCK);
+            }
+        }
+        std::cout << "Starting " << processes << " server processes (pin: " << pin << ")" << std::endl;
+        if (config.snapshot()->speculation_enabled) {
+            std::cout << "Speculative prefetch is disabled with --processes above 1" << std::endl;
+        }
+        std::cout << "Press Enter to stop the server..." << std::endl;
+        int status = runShards(processes, pin, [&](size_t shard) {
+            try {
+                serve(shard, waitForStopSignal);
+            } catch (const std::exception& e) {
+                std::cerr << "Error in process " << shard << ": " << e.what() << std::endl;
+                return 1;
+            }
+            return 0;
+        });
+        // The shared unix sockets belong to this process and outlive every shard
+        for (const auto& spec : listenerSpecs) {
+            if (spec.fd >= 0) {
+                close(spec.fd);
+                removeListenerSocket(spec.spec);
+            }
+        }
+        return status;
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
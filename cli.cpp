@@ -1,6 +1,8 @@
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <cstdlib>
+#include <thread>
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
 
@@ -20,8 +22,12 @@ static size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::stri
     return size * nmemb;
 }
 
-// Read API key from .env
+// Read API key from the environment, else from .env
 std::string readApiKeyFromEnv() {
+    if (const char* key = std::getenv("CEREBRAS_API_KEY")) {
+        return key;
+    }
+
     std::ifstream envFile(".env");
     std::string line;
     std::string apiKey;
@@ -44,24 +50,41 @@ std::string readApiKeyFromEnv() {
     return apiKey;
 }
 
+// Token counts and generation time from the last response
+struct Usage {
+    long promptTokens = 0;
+    long completionTokens = 0;
+    double completionTime = 0.0;
+};
+
 // Renamed to Clie
 class Clie {
 private:
     std::string apiKey;
+    std::string apiUrl;
     CURL* curl;
+    std::thread initThread;
+    Usage lastUsage;
 
 public:
-    Clie(const std::string& key) : apiKey(key) {
-        curl_global_init(CURL_GLOBAL_ALL);
-        curl = curl_easy_init();
+    Clie(const std::string& key) : apiKey(key), curl(nullptr) {
+        const char* url = std::getenv("CEREBRAS_API_URL");
+        apiUrl = url ? url : "https://api.cerebras.ai/v1/chat/completions";
+        // curl and SSL initialise while the user types the first question
+        initThread = std::thread([this]() {
+            curl_global_init(CURL_GLOBAL_DEFAULT);
+            curl = curl_easy_init();
+        });
     }
 
     ~Clie() {
+        if (initThread.joinable()) initThread.join();
         if (curl) curl_easy_cleanup(curl);
         curl_global_cleanup();
     }
 
     std::string ask(const std::string& question) {
+        if (initThread.joinable()) initThread.join();
         if (!curl) return "Error: CURL not initialized";
 
         json payload = {
@@ -78,7 +101,7 @@ public:
         std::string authHeader = "Authorization: Bearer " + apiKey;
         headers = curl_slist_append(headers, authHeader.c_str());
 
-        curl_easy_setopt(curl, CURLOPT_URL, "https://api.cerebras.ai/v1/chat/completions");
+        curl_easy_setopt(curl, CURLOPT_URL, apiUrl.c_str());
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payloadStr.c_str());
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
@@ -93,11 +116,21 @@ public:
 
         try {
             json responseJson = json::parse(response);
+            lastUsage = Usage();
+            if (responseJson.contains("usage")) {
+                lastUsage.promptTokens = responseJson["usage"].value("prompt_tokens", 0L);
+                lastUsage.completionTokens = responseJson["usage"].value("completion_tokens", 0L);
+            }
+            if (responseJson.contains("time_info")) {
+                lastUsage.completionTime = responseJson["time_info"].value("completion_time", 0.0);
+            }
             return responseJson["choices"][0]["message"]["content"];
         } catch (const std::exception& e) {
             return "Error parsing response: " + std::string(e.what());
         }
     }
+
+    const Usage& usage() const { return lastUsage; }
 };
 
 int main() {
@@ -119,6 +152,16 @@ int main() {
 
             std::string reply = ai.ask(input);
             std::cout << COLOR_GREEN << "\nClie: " << COLOR_RESET << reply << std::endl;
+
+            const Usage& usage = ai.usage();
+            if (usage.completionTokens > 0) {
+                std::cout << COLOR_YELLOW << "[" << usage.promptTokens << " in / "
+                          << usage.completionTokens << " out";
+                if (usage.completionTime > 0) {
+                    std::cout << ", " << (long)(usage.completionTokens / usage.completionTime) << " tok/s";
+                }
+                std::cout << "]" << COLOR_RESET << std::endl;
+            }
         }
 
     } catch (const std::exception& e) {
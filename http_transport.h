@@ -0,0 +1,834 @@
+#ifndef HTTP_TRANSPORT_H
+#define HTTP_TRANSPORT_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <sstream>
+#include <functional>
+#include <deque>
+#include <chrono>
+#include <condition_variable>
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <algorithm>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+
+#ifdef CEREBRAS_HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#ifdef CEREBRAS_HAVE_NGHTTP2
+#include <nghttp2/nghttp2.h>
+#endif
+
+// HTTP request structure
+struct HttpRequest {
+    std::string method;
+    std::string path;
+    std::map<std::string, std::string> headers;
+    std::string body;
+    std::string remote_addr;
+};
+
+// HTTP response structure
+struct HttpResponse {
+    int status_code;
+    std::map<std::string, std::string> headers;
+    std::string body;
+};
+
+inline const char* statusText(int status_code) {
+    switch (status_code) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 413: return "Payload Too Large";
+        case 429: return "Too Many Requests";
+        case 500: return "Internal Server Error";
+        case 502: return "Bad Gateway";
+        default: return "Unknown";
+    }
+}
+
+// Function to serialize an HTTP/1.1 response
+inline std::string serializeResponse(const HttpResponse& res) {
+    std::ostringstream stream;
+    stream << "HTTP/1.1 " << res.status_code << " " << statusText(res.status_code) << "\r\n";
+
+    // Headers
+    for (const auto& header : res.headers) {
+        stream << header.first << ": " << header.second << "\r\n";
+    }
+
+    // Content-Length header
+    stream << "Content-Length: " << res.body.length() << "\r\n";
+
+    // End of headers
+    stream << "\r\n";
+
+    // Body
+    stream << res.body;
+
+    return stream.str();
+}
+
+#ifdef CEREBRAS_HAVE_OPENSSL
+// Server-side TLS settings shared by every TLS listener. Sessions are cached
+// server-side and TLS 1.3 tickets are issued, so returning clients resume
+// without a full handshake. ALPN prefers h2 when HTTP/2 support is built in.
+class TlsContext {
+private:
+    SSL_CTX* ctx;
+
+    static int selectProtocol(SSL*, const unsigned char** out, unsigned char* outlen,
+                              const unsigned char* in, unsigned int inlen, void*) {
+#ifdef CEREBRAS_HAVE_NGHTTP2
+        static const unsigned char preferred[] = "\x02h2\x08http/1.1";
+#else
+        static const unsigned char preferred[] = "\x08http/1.1";
+#endif
+        if (SSL_select_next_proto(const_cast<unsigned char**>(out), outlen, preferred,
+                                  sizeof(preferred) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+        return SSL_TLSEXT_ERR_OK;
+    }
+
+public:
+    std::atomic<uint64_t> handshakes{0};
+    std::atomic<uint64_t> resumed{0};
+    std::atomic<uint64_t> failed{0};
+
+    TlsContext(const std::string& certFile, const std::string& keyFile) {
+        ctx = SSL_CTX_new(TLS_server_method());
+        if (!ctx) {
+            throw std::runtime_error("Failed to create TLS context");
+        }
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        if (SSL_CTX_use_certificate_chain_file(ctx, certFile.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx, keyFile.c_str(), SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx) != 1) {
+            SSL_CTX_free(ctx);
+            throw std::runtime_error("Failed to load TLS certificate " + certFile + " / key " + keyFile);
+        }
+
+        static const unsigned char sessionContext[] = "cerebras_server";
+        SSL_CTX_set_session_id_context(ctx, sessionContext, sizeof(sessionContext) - 1);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, 20000);
+        SSL_CTX_set_timeout(ctx, 3600);
+        SSL_CTX_set_alpn_select_cb(ctx, &TlsContext::selectProtocol, nullptr);
+    }
+
+    ~TlsContext() {
+        SSL_CTX_free(ctx);
+    }
+
+    TlsContext(const TlsContext&) = delete;
+    TlsContext& operator=(const TlsContext&) = delete;
+
+    SSL_CTX* native() const { return ctx; }
+};
+#else
+class TlsContext;
+#endif
+
+// An accepted client connection, plaintext or TLS. Owns the socket.
+class Connection {
+private:
+    int fd;
+#ifdef CEREBRAS_HAVE_OPENSSL
+    SSL* ssl = nullptr;
+#endif
+    std::string protocol = "http/1.1";
+
+public:
+    explicit Connection(int fd) : fd(fd) {}
+
+    ~Connection() {
+#ifdef CEREBRAS_HAVE_OPENSSL
+        if (ssl) {
+            if (SSL_is_init_finished(ssl)) {
+                SSL_shutdown(ssl);
+            }
+            SSL_free(ssl);
+        }
+#endif
+        close(fd);
+    }
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    // Run the server side of a TLS handshake; returns false if it fails
+    bool startTls(TlsContext* tls) {
+#ifdef CEREBRAS_HAVE_OPENSSL
+        ssl = SSL_new(tls->native());
+        SSL_set_fd(ssl, fd);
+        if (SSL_accept(ssl) != 1) {
+            tls->failed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        tls->handshakes.fetch_add(1, std::memory_order_relaxed);
+        if (SSL_session_reused(ssl)) {
+            tls->resumed.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        const unsigned char* alpn = nullptr;
+        unsigned int alpn_len = 0;
+        SSL_get0_alpn_selected(ssl, &alpn, &alpn_len);
+        if (alpn_len > 0) {
+            protocol.assign(reinterpret_cast<const char*>(alpn), alpn_len);
+        }
+        return true;
+#else
+        (void)tls;
+        return false;
+#endif
+    }
+
+    int nativeHandle() const { return fd; }
+
+    // Negotiated application protocol: "http/1.1" or "h2"
+    const std::string& applicationProtocol() const { return protocol; }
+
+    ssize_t read(void* buffer, size_t length) {
+#ifdef CEREBRAS_HAVE_OPENSSL
+        if (ssl) {
+            int n = SSL_read(ssl, buffer, static_cast<int>(length));
+            return n > 0 ? n : -1;
+        }
+#endif
+        return ::read(fd, buffer, length);
+    }
+
+    // Function to write a whole buffer, retrying on partial writes
+    bool writeAll(const char* data, size_t length) {
+        size_t written = 0;
+        while (written < length) {
+            ssize_t n;
+#ifdef CEREBRAS_HAVE_OPENSSL
+            if (ssl) {
+                n = SSL_write(ssl, data + written, static_cast<int>(length - written));
+            } else
+#endif
+            {
+                n = ::write(fd, data + written, length - written);
+            }
+            if (n <= 0) {
+                return false;
+            }
+            written += n;
+        }
+        return true;
+    }
+
+    bool writeAll(const std::string& data) {
+        return writeAll(data.data(), data.size());
+    }
+
+    // Decrypted bytes already buffered, which poll() on the socket cannot see
+    bool hasBufferedData() const {
+#ifdef CEREBRAS_HAVE_OPENSSL
+        return ssl && SSL_pending(ssl) > 0;
+#else
+        return false;
+#endif
+    }
+
+    // Function to get the printable address of the connected peer
+    std::string peerAddress() const {
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        char addr[INET6_ADDRSTRLEN] = {0};
+        if (getpeername(fd, (struct sockaddr *)&peer, &peer_len) != 0) {
+            return "unknown";
+        }
+        if (peer.ss_family == AF_INET &&
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&peer)->sin_addr, addr, sizeof(addr))) {
+            return addr;
+        }
+        if (peer.ss_family == AF_INET6 &&
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&peer)->sin6_addr, addr, sizeof(addr))) {
+            return addr;
+        }
+        if (peer.ss_family == AF_UNIX) {
+            return "unix";
+        }
+        return "unknown";
+    }
+};
+
+// Create a listening socket for "HOST:PORT", "[IPV6]:PORT", ":PORT" or
+// "unix:/path/to/socket". Throws with a readable message on failure. With
+// `reuse_port`, several processes can each bind their own TCP socket to the
+// same address and the kernel balances new connections across them.
+inline int openListener(const std::string& spec, int backlog = 128, bool reuse_port = false) {
+    int fd = -1;
+    int opt = 1;
+
+    if (spec.compare(0, 5, "unix:") == 0) {
+        std::string path = spec.substr(5);
+        struct sockaddr_un address = {};
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Invalid unix socket path: " + path);
+        }
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+        // Replace a socket left behind by an earlier run, but never another kind of file
+        struct stat info;
+        if (lstat(path.c_str(), &info) == 0) {
+            if (!S_ISSOCK(info.st_mode)) {
+                throw std::runtime_error("Refusing to replace " + path + ": not a socket");
+            }
+            unlink(path.c_str());
+        }
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+            if (fd >= 0) close(fd);
+            throw std::runtime_error("Bind failed for " + spec + ": " + std::strerror(errno));
+        }
+    } else {
+        size_t colon = spec.rfind(':');
+        std::string host = colon == std::string::npos ? "" : spec.substr(0, colon);
+        std::string port_text = colon == std::string::npos ? spec : spec.substr(colon + 1);
+        char* end = nullptr;
+        errno = 0;
+        long port = std::strtol(port_text.c_str(), &end, 10);
+        if (port_text.empty() || *end != '\0' || errno == ERANGE || port < 1 || port > 65535) {
+            throw std::runtime_error("Invalid port in " + spec + ": expected a number from 1 to 65535");
+        }
+
+        struct sockaddr_storage address = {};
+        socklen_t addrlen;
+        bool ipv6 = host.size() >= 2 && host.front() == '[' && host.back() == ']';
+        if (ipv6) {
+            auto* addr6 = (struct sockaddr_in6 *)&address;
+            addr6->sin6_family = AF_INET6;
+            addr6->sin6_port = htons(port);
+            if (inet_pton(AF_INET6, host.substr(1, host.size() - 2).c_str(), &addr6->sin6_addr) != 1) {
+                throw std::runtime_error("Invalid IPv6 address: " + host);
+            }
+            addrlen = sizeof(struct sockaddr_in6);
+        } else {
+            auto* addr4 = (struct sockaddr_in *)&address;
+            addr4->sin_family = AF_INET;
+            addr4->sin_port = htons(port);
+            if (host.empty() || host == "*") {
+                addr4->sin_addr.s_addr = INADDR_ANY;
+            } else if (inet_pton(AF_INET, host.c_str(), &addr4->sin_addr) != 1) {
+                throw std::runtime_error("Invalid IPv4 address: " + host);
+            }
+            addrlen = sizeof(struct sockaddr_in);
+        }
+
+        fd = socket(address.ss_family, SOCK_STREAM, 0);
+        if (fd < 0) {
+            throw std::runtime_error("Socket failed for " + spec);
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            close(fd);
+            throw std::runtime_error("SO_REUSEPORT failed for " + spec + ": " + std::strerror(errno));
+        }
+        if (ipv6) {
+            // Keep IPv6 listeners separate so they can share a port with IPv4 ones
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
+        }
+        if (bind(fd, (struct sockaddr *)&address, addrlen) < 0) {
+            close(fd);
+            throw std::runtime_error("Bind failed for " + spec + ": " + std::strerror(errno));
+        }
+    }
+
+    if (listen(fd, backlog) < 0) {
+        close(fd);
+        throw std::runtime_error("Listen failed for " + spec);
+    }
+    return fd;
+}
+
+// Remove the socket file of a "unix:/path" listener once it is closed.
+// Other specs have nothing on disk and are ignored.
+inline void removeListenerSocket(const std::string& spec) {
+    if (spec.compare(0, 5, "unix:") == 0) {
+        unlink(spec.c_str() + 5);
+    }
+}
+
+// Destination for a response. Handlers either send a complete response or
+// stream one: begin() with the status and headers, write() body pieces as
+// they become available, then end().
+class ResponseStream {
+public:
+    virtual ~ResponseStream() {}
+    virtual bool send(const HttpResponse& res) = 0;
+    virtual bool begin(int status_code, const std::map<std::string, std::string>& headers) = 0;
+    virtual bool write(const std::string& data) = 0;
+    virtual bool end() = 0;
+};
+
+// HTTP/1.1 responses: complete ones with Content-Length, streamed ones with
+// chunked transfer encoding. The connection is closed after each response.
+class Http1ResponseStream : public ResponseStream {
+private:
+    Connection& conn;
+
+public:
+    explicit Http1ResponseStream(Connection& conn) : conn(conn) {}
+
+    bool send(const HttpResponse& res) override {
+        HttpResponse closing = res;
+        closing.headers["Connection"] = "close";
+        return conn.writeAll(serializeResponse(closing));
+    }
+
+    bool begin(int status_code, const std::map<std::string, std::string>& headers) override {
+        std::ostringstream stream;
+        stream << "HTTP/1.1 " << status_code << " " << statusText(status_code) << "\r\n";
+        for (const auto& header : headers) {
+            stream << header.first << ": " << header.second << "\r\n";
+        }
+        stream << "Connection: close\r\nTransfer-Encoding: chunked\r\n\r\n";
+        return conn.writeAll(stream.str());
+    }
+
+    bool write(const std::string& data) override {
+        if (data.empty()) {
+            return true;
+        }
+        std::ostringstream chunk;
+        chunk << std::hex << data.size() << "\r\n" << data << "\r\n";
+        return conn.writeAll(chunk.str());
+    }
+
+    bool end() override {
+        return conn.writeAll("0\r\n\r\n");
+    }
+};
+
+#ifdef CEREBRAS_HAVE_NGHTTP2
+// HTTP/2 server side of one connection. Stream requests are handled on a
+// small per-connection pool of threads, so concurrent /api/chat calls
+// multiplex over a single connection; streams beyond the pool size queue.
+// Only the connection thread touches the nghttp2 session; handler threads
+// fill per-stream output buffers and wake it through a pipe.
+class Http2Session {
+public:
+    using Handler = std::function<void(const HttpRequest&, ResponseStream&)>;
+
+private:
+    static constexpr uint32_t kMaxConcurrentStreams = 64;
+    static constexpr size_t kMaxHandlerThreads = 8;
+
+    // Output side of one stream, shared between its handler and the session
+    struct StreamState {
+        int32_t id;
+        HttpRequest request;
+        bool rejected = false;  // reset for exceeding the body limit
+        std::mutex mutex;
+        bool head_ready = false;
+        bool submitted = false;
+        bool ended = false;
+        int status_code = 200;
+        std::map<std::string, std::string> headers;
+        std::string pending;
+        size_t offset = 0;
+    };
+
+    // Wakes the connection thread when a handler produced output
+    struct Notifier {
+        int fds[2];
+        std::mutex mutex;
+        std::vector<int32_t> ready;
+
+        Notifier() {
+            if (pipe(fds) < 0) {
+                throw std::runtime_error("pipe() failed");
+            }
+            fcntl(fds[0], F_SETFL, O_NONBLOCK);
+            fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        }
+        ~Notifier() {
+            close(fds[0]);
+            close(fds[1]);
+        }
+        void notify(int32_t stream_id) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ready.push_back(stream_id);
+            }
+            char byte = 1;
+            (void)::write(fds[1], &byte, 1);
+        }
+        std::vector<int32_t> take() {
+            char buffer[256];
+            while (::read(fds[0], buffer, sizeof(buffer)) > 0) {}
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<int32_t> ids;
+            ids.swap(ready);
+            return ids;
+        }
+    };
+
+    class StreamWriter : public ResponseStream {
+    private:
+        std::shared_ptr<StreamState> state;
+        std::shared_ptr<Notifier> notifier;
+
+    public:
+        StreamWriter(std::shared_ptr<StreamState> state, std::shared_ptr<Notifier> notifier)
+            : state(std::move(state)), notifier(std::move(notifier)) {}
+
+        bool send(const HttpResponse& res) override {
+            std::map<std::string, std::string> headers = res.headers;
+            headers["Content-Length"] = std::to_string(res.body.size());
+            return begin(res.status_code, headers) && write(res.body) && end();
+        }
+
+        bool begin(int status_code, const std::map<std::string, std::string>& headers) override {
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->status_code = status_code;
+                state->headers = headers;
+                state->head_ready = true;
+            }
+            notifier->notify(state->id);
+            return true;
+        }
+
+        bool write(const std::string& data) override {
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->pending += data;
+            }
+            notifier->notify(state->id);
+            return true;
+        }
+
+        bool end() override {
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->ended = true;
+            }
+            notifier->notify(state->id);
+            return true;
+        }
+    };
+
+    Connection& conn;
+    Handler handler;
+    std::chrono::milliseconds idle_timeout;
+    size_t max_body_bytes;
+    nghttp2_session* session = nullptr;
+    std::shared_ptr<Notifier> notifier;
+    std::map<int32_t, std::shared_ptr<StreamState>> streams;
+
+    // Requests waiting for, or running on, the handler pool
+    std::vector<std::thread> pool;
+    std::deque<std::shared_ptr<StreamState>> queued;
+    size_t idle_handlers = 0;
+    size_t unfinished = 0;
+    bool closing = false;
+    std::mutex pool_mutex;
+    std::condition_variable pool_ready;
+
+    // HTTP/2 header names are lowercase; handlers expect "Content-Length" style
+    static std::string canonicalHeader(const std::string& name) {
+        std::string result = name;
+        bool upper = true;
+        for (char& c : result) {
+            c = upper ? static_cast<char>(std::toupper(static_cast<unsigned char>(c))) : c;
+            upper = c == '-';
+        }
+        return result;
+    }
+
+    static std::string lowercase(std::string name) {
+        for (char& c : name) {
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        }
+        return name;
+    }
+
+    static ssize_t onSend(nghttp2_session*, const uint8_t* data, size_t length, int, void* user_data) {
+        auto* self = static_cast<Http2Session*>(user_data);
+        if (!self->conn.writeAll(reinterpret_cast<const char*>(data), length)) {
+            return NGHTTP2_ERR_CALLBACK_FAILURE;
+        }
+        return static_cast<ssize_t>(length);
+    }
+
+    static int onBeginHeaders(nghttp2_session* session, const nghttp2_frame* frame, void* user_data) {
+        auto* self = static_cast<Http2Session*>(user_data);
+        if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+            return 0;
+        }
+        auto state = std::make_shared<StreamState>();
+        state->id = frame->hd.stream_id;
+        state->request.remote_addr = self->conn.peerAddress();
+        self->streams[state->id] = state;
+        nghttp2_session_set_stream_user_data(session, state->id, state.get());
+        return 0;
+    }
+
+    static int onHeader(nghttp2_session* session, const nghttp2_frame* frame, const uint8_t* name,
+                        size_t namelen, const uint8_t* value, size_t valuelen, uint8_t, void*) {
+        auto* state = static_cast<StreamState*>(nghttp2_session_get_stream_user_data(session, frame->hd.stream_id));
+        if (!state) {
+            return 0;
+        }
+        std::string key(reinterpret_cast<const char*>(name), namelen);
+        std::string val(reinterpret_cast<const char*>(value), valuelen);
+        if (key == ":method") {
+            state->request.method = val;
+        } else if (key == ":path") {
+            state->request.path = val;
+        } else if (!key.empty() && key[0] != ':') {
+            state->request.headers[canonicalHeader(key)] = val;
+        }
+        return 0;
+    }
+
+    static int onDataChunk(nghttp2_session* session, uint8_t, int32_t stream_id,
+                           const uint8_t* data, size_t len, void* user_data) {
+        auto* self = static_cast<Http2Session*>(user_data);
+        auto* state = static_cast<StreamState*>(nghttp2_session_get_stream_user_data(session, stream_id));
+        if (!state || state->rejected) {
+            return 0;
+        }
+        if (state->request.body.size() + len > self->max_body_bytes) {
+            state->rejected = true;
+            state->request.body.clear();
+            nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream_id, NGHTTP2_CANCEL);
+            return 0;
+        }
+        state->request.body.append(reinterpret_cast<const char*>(data), len);
+        return 0;
+    }
+
+    static int onFrameRecv(nghttp2_session*, const nghttp2_frame* frame, void* user_data) {
+        auto* self = static_cast<Http2Session*>(user_data);
+        bool request_complete = (frame->hd.type == NGHTTP2_HEADERS || frame->hd.type == NGHTTP2_DATA) &&
+                                (frame->hd.flags & NGHTTP2_FLAG_END_STREAM);
+        if (request_complete) {
+            self->dispatch(frame->hd.stream_id);
+        }
+        return 0;
+    }
+
+    static int onStreamClose(nghttp2_session*, int32_t stream_id, uint32_t, void* user_data) {
+        static_cast<Http2Session*>(user_data)->streams.erase(stream_id);
+        return 0;
+    }
+
+    static ssize_t readBody(nghttp2_session*, int32_t, uint8_t* buf, size_t length,
+                            uint32_t* data_flags, nghttp2_data_source* source, void*) {
+        auto* state = static_cast<StreamState*>(source->ptr);
+        std::lock_guard<std::mutex> lock(state->mutex);
+        size_t available = state->pending.size() - state->offset;
+        size_t n = std::min(available, length);
+        std::memcpy(buf, state->pending.data() + state->offset, n);
+        state->offset += n;
+        if (state->offset == state->pending.size()) {
+            state->pending.clear();
+            state->offset = 0;
+            if (state->ended) {
+                *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+            } else if (n == 0) {
+                return NGHTTP2_ERR_DEFERRED;
+            }
+        }
+        return static_cast<ssize_t>(n);
+    }
+
+    void dispatch(int32_t stream_id) {
+        auto it = streams.find(stream_id);
+        if (it == streams.end() || it->second->rejected) {
+            return;
+        }
+        std::shared_ptr<StreamState> state = it->second;
+        state->request.headers["Content-Length"] = std::to_string(state->request.body.size());
+
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        queued.push_back(state);
+        unfinished++;
+        // Idle threads may not have woken for earlier requests yet, so a
+        // thread is added whenever queued requests outnumber them
+        if (queued.size() > idle_handlers && pool.size() < kMaxHandlerThreads) {
+            pool.emplace_back(&Http2Session::handlerLoop, this);
+        } else {
+            pool_ready.notify_one();
+        }
+    }
+
+    void handlerLoop() {
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        while (true) {
+            idle_handlers++;
+            pool_ready.wait(lock, [this]() { return closing || !queued.empty(); });
+            idle_handlers--;
+            if (queued.empty()) {
+                return;
+            }
+            std::shared_ptr<StreamState> state = queued.front();
+            queued.pop_front();
+            lock.unlock();
+
+            StreamWriter writer(state, notifier);
+            handler(state->request, writer);
+
+            lock.lock();
+            unfinished--;
+        }
+    }
+
+    bool handlersBusy() {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        return unfinished > 0;
+    }
+
+    // Submit response headers for streams whose handler has started
+    // answering, and resume streams that have new body data
+    void flushReady() {
+        for (int32_t stream_id : notifier->take()) {
+            auto it = streams.find(stream_id);
+            if (it == streams.end()) {
+                continue;
+            }
+            StreamState& state = *it->second;
+
+            std::vector<std::pair<std::string, std::string>> fields;
+            {
+                std::lock_guard<std::mutex> lock(state.mutex);
+                if (state.submitted || !state.head_ready) {
+                    if (state.submitted) {
+                        nghttp2_session_resume_data(session, stream_id);
+                    }
+                    continue;
+                }
+                state.submitted = true;
+                fields.emplace_back(":status", std::to_string(state.status_code));
+                for (const auto& header : state.headers) {
+                    fields.emplace_back(lowercase(header.first), header.second);
+                }
+            }
+
+            std::vector<nghttp2_nv> nva;
+            for (auto& field : fields) {
+                nva.push_back({reinterpret_cast<uint8_t*>(&field.first[0]),
+                               reinterpret_cast<uint8_t*>(&field.second[0]),
+                               field.first.size(), field.second.size(), NGHTTP2_NV_FLAG_NONE});
+            }
+            nghttp2_data_provider provider;
+            provider.source.ptr = &state;
+            provider.read_callback = &Http2Session::readBody;
+            nghttp2_submit_response(session, stream_id, nva.data(), nva.size(), &provider);
+        }
+    }
+
+public:
+    // The session is closed once no request has been running for
+    // `idle_timeout` and the client has sent nothing in that time. Streams
+    // whose body grows past `max_body_bytes` are reset.
+    Http2Session(Connection& conn, Handler handler, std::chrono::milliseconds idle_timeout, size_t max_body_bytes)
+        : conn(conn), handler(std::move(handler)), idle_timeout(idle_timeout), max_body_bytes(max_body_bytes),
+          notifier(std::make_shared<Notifier>()) {
+        nghttp2_session_callbacks* callbacks;
+        nghttp2_session_callbacks_new(&callbacks);
+        nghttp2_session_callbacks_set_send_callback(callbacks, &Http2Session::onSend);
+        nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, &Http2Session::onBeginHeaders);
+        nghttp2_session_callbacks_set_on_header_callback(callbacks, &Http2Session::onHeader);
+        nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, &Http2Session::onDataChunk);
+        nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, &Http2Session::onFrameRecv);
+        nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, &Http2Session::onStreamClose);
+        nghttp2_session_server_new(&session, callbacks, this);
+        nghttp2_session_callbacks_del(callbacks);
+
+        nghttp2_settings_entry settings[] = {{NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, kMaxConcurrentStreams}};
+        nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, settings, 1);
+    }
+
+    // Requests already handed to the pool still run to completion, since
+    // their handlers may hold upstream calls and usage accounting
+    ~Http2Session() {
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            closing = true;
+        }
+        pool_ready.notify_all();
+        for (auto& thread : pool) {
+            thread.join();
+        }
+        nghttp2_session_del(session);
+    }
+
+    // Serve the connection until the client goes away, the session ends or
+    // it has been idle for longer than the idle timeout
+    void run() {
+        char buffer[16384];
+        auto last_read = std::chrono::steady_clock::now();
+        while (true) {
+            if (nghttp2_session_send(session) != 0) {
+                break;
+            }
+            if (!nghttp2_session_want_read(session) && !nghttp2_session_want_write(session)) {
+                break;
+            }
+
+            if (!conn.hasBufferedData()) {
+                // Wake at least once a second to check the idle deadline
+                int wait_ms = 1000;
+                if (!handlersBusy()) {
+                    auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - last_read);
+                    if (idle >= idle_timeout) {
+                        nghttp2_session_terminate_session(session, NGHTTP2_NO_ERROR);
+                        nghttp2_session_send(session);
+                        break;
+                    }
+                    wait_ms = static_cast<int>(std::min<int64_t>(wait_ms, (idle_timeout - idle).count()));
+                }
+
+                struct pollfd fds[2] = {{conn.nativeHandle(), POLLIN, 0}, {notifier->fds[0], POLLIN, 0}};
+                if (poll(fds, 2, wait_ms) < 0 && errno != EINTR) {
+                    break;
+                }
+                if (fds[1].revents & POLLIN) {
+                    flushReady();
+                }
+                if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+                    continue;
+                }
+            }
+
+            ssize_t n = conn.read(buffer, sizeof(buffer));
+            if (n <= 0 || nghttp2_session_mem_recv(session, reinterpret_cast<uint8_t*>(buffer), n) < 0) {
+                break;
+            }
+            last_read = std::chrono::steady_clock::now();
+        }
+    }
+};
+#endif
+
+#endif // HTTP_TRANSPORT_H
@@ -0,0 +1,589 @@
+#ifndef PROCESS_SHARDS_H
+#define PROCESS_SHARDS_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include <new>
+#include <cerrno>
+#include <cctype>
+#include <cstring>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+
+#include <sched.h>
+#include <signal.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+// Shared memory is only safe to update across processes with atomics that
+// never fall back to a process-local lock
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "64-bit atomics must be lock-free");
+
+// One T in an anonymous shared mapping. Created before the shards are
+// forked, it is the same memory in the parent and every child, so T must be
+// address-free: atomics and fixed-size arrays, nothing that owns heap memory.
+// Members without initializers are left as the zero pages mmap returns, so
+// large arrays cost nothing until they are written.
+template<typename T>
+class SharedMapping {
+    static_assert(std::is_trivially_destructible<T>::value, "shared state must not own heap memory");
+
+private:
+    T* object;
+
+public:
+    SharedMapping() {
+        void* memory = mmap(nullptr, sizeof(T), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (memory == MAP_FAILED) {
+            throw std::runtime_error(std::string("Shared memory mapping failed: ") + std::strerror(errno));
+        }
+        object = new (memory) T;
+    }
+
+    ~SharedMapping() {
+        munmap(object, sizeof(T));
+    }
+
+    SharedMapping(const SharedMapping&) = delete;
+    SharedMapping& operator=(const SharedMapping&) = delete;
+
+    T& operator*() const { return *object; }
+    T* operator->() const { return object; }
+};
+
+// 64-bit FNV-1a with a seeded basis and a final avalanche, so two seeds give
+// two practically independent hashes of the same key. 0 is reserved for
+// empty slots.
+inline uint64_t sharedKeyHash(const std::string& key, uint64_t seed = 0) {
+    uint64_t h = 1469598103934665603ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+    for (unsigned char c : key) {
+        h = (h ^ c) * 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+// Milliseconds on the monotonic clock, which every process on the host shares
+inline uint64_t sharedClockMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Whether the process that started writing a shared slot has exited, so the
+// write will never be finished. Pids are reused, which can only make a dead
+// writer look alive and delay reclaiming its slot.
+inline bool sharedWriterGone(uint32_t pid) {
+    return kill(static_cast<pid_t>(pid), 0) != 0 && errno == ESRCH;
+}
+
+// Per-client token buckets in a fixed-size table that shards update without
+// locks. A bucket is one 64-bit word, changed with CAS: the time it was last
+// refilled in milliseconds (40 bits) and its level in thousandths of a
+// request (24 bits, so bursts are capped at kMaxBurst). Clients are found by key hash with linear probing. When a probe
+// run is full, a bucket that has been idle long enough to refill completely is
+// handed to the new client, since a full bucket and a fresh one are the same.
+// A request racing with that handover may be charged to the new client.
+template<size_t N>
+class RateLimiter {
+private:
+    static constexpr size_t kProbe = 16;
+    static constexpr uint64_t kUnit = 1000;  // bucket level units per request
+    static constexpr uint64_t kLevelMask = (1ULL << 24) - 1;
+    static constexpr uint64_t kMaxIdleMillis = 2000000000ULL;  // > kMaxBurst minutes
+
+    struct Slot {
+        std::atomic<uint64_t> hash{0};
+        std::atomic<uint64_t> state{0};  // 0: never used
+    };
+
+    Slot slots[N];
+    std::atomic<uint64_t> allowed{0};
+    std::atomic<uint64_t> limited{0};
+    std::atomic<uint64_t> untracked{0};  // allowed because the table had no room
+
+    static uint64_t pack(uint64_t time, uint64_t level) {
+        uint64_t state = (time << 24) | level;
+        return state ? state : 1;
+    }
+
+    // Level after refilling up to `now`, and the refill time to store with it.
+    // The stored time only advances by the time the whole units added took,
+    // so slow refill rates are not lost to rounding between requests.
+    static uint64_t refill(uint64_t state, uint64_t now, uint64_t per_minute, uint64_t capacity, uint64_t& time) {
+        if (state == 0) {
+            time = now;
+            return capacity;
+        }
+        time = state >> 24;
+        uint64_t level = state & kLevelMask;
+        // Another shard may have stored a clock reading taken after ours. Any
+        // bucket is full again after kMaxIdleMillis, and the cap keeps the
+        // products below from overflowing.
+        uint64_t elapsed = now > time ? std::min(now - time, kMaxIdleMillis) : 0;
+        uint64_t added = elapsed * per_minute * kUnit / 60000;
+        if (level + added >= capacity) {
+            time = now;
+            return capacity;
+        }
+        time += added * 60000 / (per_minute * kUnit);
+        return level + added;
+    }
+
+    Slot* find(uint64_t h, uint64_t now, uint64_t per_minute, uint64_t capacity) {
+        for (size_t i = 0; i < kProbe; i++) {
+            Slot& slot = slots[(h + i) % N];
+            uint64_t current = slot.hash.load(std::memory_order_acquire);
+            if (current == h) {
+                return &slot;
+            }
+            if (current == 0) {
+                uint64_t expected = 0;
+                if (slot.hash.compare_exchange_strong(expected, h, std::memory_order_acq_rel) || expected == h) {
+                    return &slot;
+                }
+            }
+        }
+        for (size_t i = 0; i < kProbe; i++) {
+            Slot& slot = slots[(h + i) % N];
+            uint64_t time;
+            uint64_t current = slot.hash.load(std::memory_order_acquire);
+            if (refill(slot.state.load(std::memory_order_acquire), now, per_minute, capacity, time) >= capacity &&
+                slot.hash.compare_exchange_strong(current, h, std::memory_order_acq_rel)) {
+                slot.state.store(0, std::memory_order_release);
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+public:
+    static constexpr uint64_t kMaxBurst = kLevelMask / kUnit;
+
+    // Take one request from `client`'s bucket, which holds up to `burst`
+    // requests and refills at `per_minute`. Returns 0 when the request may
+    // proceed, else the milliseconds until the bucket has room for it.
+    uint64_t acquire(const std::string& client, uint64_t per_minute, uint64_t burst) {
+        if (per_minute == 0) {
+            return 0;
+        }
+        uint64_t capacity = burst * kUnit;
+        uint64_t now = sharedClockMillis() & ((1ULL << 40) - 1);
+        Slot* slot = find(sharedKeyHash(client), now, per_minute, capacity);
+        if (!slot) {
+            untracked.fetch_add(1, std::memory_order_relaxed);
+            return 0;
+        }
+
+        uint64_t state = slot->state.load(std::memory_order_acquire);
+        while (true) {
+            uint64_t time;
+            uint64_t level = refill(state, now, per_minute, capacity, time);
+            if (level < kUnit) {
+                limited.fetch_add(1, std::memory_order_relaxed);
+                return ((kUnit - level) * 60000 + per_minute * kUnit - 1) / (per_minute * kUnit);
+            }
+            if (slot->state.compare_exchange_weak(state, pack(time, level - kUnit), std::memory_order_acq_rel)) {
+                allowed.fetch_add(1, std::memory_order_relaxed);
+                return 0;
+            }
+        }
+    }
+
+    nlohmann::json toJson() const {
+        size_t clients = 0;
+        for (const Slot& slot : slots) {
+            clients += slot.hash.load(std::memory_order_relaxed) != 0;
+        }
+        return {
+            {"allowed", allowed.load(std::memory_order_relaxed)},
+            {"limited", limited.load(std::memory_order_relaxed)},
+            {"untracked", untracked.load(std::memory_order_relaxed)},
+            {"clients", clients},
+            {"capacity", N}
+        };
+    }
+};
+
+// Response bodies shared by every shard, each in a fixed-size slot found by
+// key hash among kWays neighbours. A slot is guarded by a sequence counter: a
+// writer claims it by moving the counter from even to odd, copies the entry
+// in and publishes it with the next even value. Readers copy without locking
+// and treat a counter that moved meanwhile as a miss. Neither side ever waits;
+// a writer skips a slot another shard is writing. The odd value carries the
+// writer's pid, so a slot left odd by a shard that died mid-write is taken
+// over by the next writer instead of staying unusable.
+template<size_t Slots, size_t SlotBytes>
+class ResponseCache {
+private:
+    static constexpr size_t kWays = 4;
+
+    struct Slot {
+        std::atomic<uint64_t> sequence{0};    // generation << 32, or | writer pid << 1 | 1 while written
+        std::atomic<uint64_t> hash{0};
+        std::atomic<uint64_t> check{0};       // second hash of the key, against collisions
+        std::atomic<uint64_t> expires_ms{0};  // sharedClockMillis() deadline
+        std::atomic<uint64_t> size{0};
+        char body[SlotBytes];
+    };
+
+    Slot slots[Slots];
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> stores{0};
+    std::atomic<uint64_t> evictions{0};   // live entries replaced to make room
+    std::atomic<uint64_t> too_large{0};
+    std::atomic<uint64_t> contended{0};   // lookups or stores that met a slot being written
+
+    Slot& way(uint64_t hash, size_t i) {
+        return slots[(hash + i) % Slots];
+    }
+
+    static bool abandoned(uint64_t sequence) {
+        return (sequence & 1) && sharedWriterGone(static_cast<uint32_t>(sequence) >> 1);
+    }
+
+public:
+    static constexpr size_t kMaxBody = SlotBytes;
+
+    bool get(const std::string& key, std::string& body) {
+        uint64_t hash = sharedKeyHash(key), check = sharedKeyHash(key, 1);
+        uint64_t now = sharedClockMillis();
+        for (size_t i = 0; i < kWays; i++) {
+            Slot& slot = way(hash, i);
+            uint64_t before = slot.sequence.load(std::memory_order_acquire);
+            if (slot.hash.load(std::memory_order_relaxed) != hash) {
+                continue;
+            }
+            if (before & 1) {
+                contended.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            if (slot.check.load(std::memory_order_relaxed) != check ||
+                slot.expires_ms.load(std::memory_order_relaxed) <= now) {
+                continue;
+            }
+            size_t size = std::min<uint64_t>(slot.size.load(std::memory_order_relaxed), SlotBytes);
+            std::string copy(slot.body, size);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) != before) {
+                contended.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            body.swap(copy);
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Store `body` for `ttl_ms`, over the same key, an expired entry or else
+    // the entry closest to expiring. Bodies over SlotBytes are not cached.
+    void put(const std::string& key, const std::string& body, uint64_t ttl_ms) {
+        if (body.size() > SlotBytes) {
+            too_large.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        uint64_t hash = sharedKeyHash(key), check = sharedKeyHash(key, 1);
+        uint64_t now = sharedClockMillis();
+
+        Slot* target = nullptr;
+        for (size_t i = 0; i < kWays; i++) {
+            Slot& slot = way(hash, i);
+            if (slot.hash.load(std::memory_order_relaxed) == hash) {
+                target = &slot;
+                break;
+            }
+            if (!target || slot.expires_ms.load(std::memory_order_relaxed) <
+                           target->expires_ms.load(std::memory_order_relaxed)) {
+                target = &slot;
+            }
+        }
+
+        uint64_t sequence = target->sequence.load(std::memory_order_relaxed);
+        uint64_t writing = (sequence & ~0xffffffffULL) | static_cast<uint64_t>(getpid()) << 1 | 1;
+        if (((sequence & 1) && !abandoned(sequence)) ||
+            !target->sequence.compare_exchange_strong(sequence, writing, std::memory_order_relaxed)) {
+            contended.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        if (target->hash.load(std::memory_order_relaxed) != hash &&
+            target->expires_ms.load(std::memory_order_relaxed) > now) {
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+        target->hash.store(hash, std::memory_order_relaxed);
+        target->check.store(check, std::memory_order_relaxed);
+        target->expires_ms.store(now + ttl_ms, std::memory_order_relaxed);
+        target->size.store(body.size(), std::memory_order_relaxed);
+        std::memcpy(target->body, body.data(), body.size());
+        target->sequence.store((sequence & ~0xffffffffULL) + (1ULL << 32), std::memory_order_release);
+        stores.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    nlohmann::json toJson() const {
+        uint64_t now = sharedClockMillis();
+        size_t entries = 0;
+        for (const Slot& slot : slots) {
+            entries += slot.expires_ms.load(std::memory_order_relaxed) > now;
+        }
+        uint64_t hit_count = hits.load(std::memory_order_relaxed);
+        uint64_t lookups = hit_count + misses.load(std::memory_order_relaxed);
+        return {
+            {"entries", entries},
+            {"capacity", Slots},
+            {"max_body_bytes", SlotBytes},
+            {"hits", hit_count},
+            {"misses", misses.load(std::memory_order_relaxed)},
+            {"hit_rate", lookups ? static_cast<double>(hit_count) / lookups : 0.0},
+            {"stores", stores.load(std::memory_order_relaxed)},
+            {"evictions", evictions.load(std::memory_order_relaxed)},
+            {"too_large", too_large.load(std::memory_order_relaxed)},
+            {"contended", contended.load(std::memory_order_relaxed)}
+        };
+    }
+};
+
+// "0-3,8,10-11" as used by /sys/devices/system/node/*/cpulist
+inline std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::istringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        if (range.empty() || !std::isdigit(static_cast<unsigned char>(range[0]))) {
+            continue;
+        }
+        size_t dash = range.find('-');
+        int first = std::stoi(range);
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// The CPUs this process may run on, grouped by NUMA node. One group holding
+// every allowed CPU when the machine reports no NUMA topology.
+inline std::vector<std::vector<int>> numaNodeCpus() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return {};
+    }
+
+    std::vector<std::vector<int>> nodes;
+    if (DIR* dir = opendir("/sys/devices/system/node")) {
+        std::vector<int> ids;
+        while (struct dirent* entry = readdir(dir)) {
+            if (std::strncmp(entry->d_name, "node", 4) == 0 && std::isdigit(static_cast<unsigned char>(entry->d_name[4]))) {
+                ids.push_back(std::atoi(entry->d_name + 4));
+            }
+        }
+        closedir(dir);
+        std::sort(ids.begin(), ids.end());
+        for (int id : ids) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+            std::string list;
+            std::getline(file, list);
+            std::vector<int> cpus;
+            for (int cpu : parseCpuList(list)) {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                    cpus.push_back(cpu);
+                }
+            }
+            if (!cpus.empty()) {
+                nodes.push_back(cpus);
+            }
+        }
+    }
+    if (nodes.empty()) {
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+        }
+        nodes.push_back(cpus);
+    }
+    return nodes;
+}
+
+// CPUs for shard `shard` of `shards`. Shards are dealt round-robin across
+// NUMA nodes. With `pin` "node" a shard may use every CPU of its node; with
+// "cpu" the node's CPUs are split into disjoint slices, one per shard on the
+// node (shards share CPUs only when there are more shards than CPUs). Empty
+// for "none".
+inline std::vector<int> shardCpus(size_t shard, size_t shards, const std::string& pin) {
+    if (pin == "none") {
+        return {};
+    }
+    std::vector<std::vector<int>> nodes = numaNodeCpus();
+    if (nodes.empty()) {
+        return {};
+    }
+    const std::vector<int>& node = nodes[shard % nodes.size()];
+    if (pin == "node") {
+        return node;
+    }
+
+    size_t on_node = (shards - shard % nodes.size() + nodes.size() - 1) / nodes.size();
+    size_t position = shard / nodes.size();
+    if (on_node >= node.size()) {
+        return {node[position % node.size()]};
+    }
+    size_t begin = node.size() * position / on_node;
+    size_t end = node.size() * (position + 1) / on_node;
+    return std::vector<int>(node.begin() + begin, node.begin() + end);
+}
+
+// Restrict the calling process, and every thread it starts afterwards, to
+// `cpus`. Memory is then allocated on their node by the kernel's first-touch
+// policy.
+inline bool pinToCpus(const std::vector<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// Block until this shard is asked to stop with SIGTERM or SIGINT
+inline void waitForStopSignal() {
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGINT);
+    int signal;
+    sigwait(&stop, &signal);
+}
+
+// Run `serve` for shards 0..shards-1, each in a forked child pinned per
+// `pin`, and keep them running. A child that dies is forked again, unless it
+// dies within kStartupGraceSeconds of starting: that is a startup failure
+// (say, an address in use) and stops the whole group. Returns once stdin
+// reaches a newline or EOF, or on SIGTERM/SIGINT, after stopping every child
+// with SIGTERM; 1 if a shard failed to start or to stop cleanly.
+inline int runShards(size_t shards, const std::string& pin, const std::function<int(size_t)>& serve) {
+    static constexpr int kStartupGraceSeconds = 2;
+
+    // Children inherit the mask, so their server threads leave SIGTERM to sigwait
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    pid_t parent = getpid();
+    std::vector<pid_t> pids(shards, -1);
+    std::vector<std::chrono::steady_clock::time_point> started(shards);
+    auto spawn = [&](size_t shard) {
+        std::cout.flush();
+        std::cerr.flush();
+        pid_t pid = fork();
+        if (pid < 0) {
+            throw std::runtime_error(std::string("fork() failed: ") + std::strerror(errno));
+        }
+        if (pid == 0) {
+#ifdef __linux__
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+            if (getppid() != parent) {
+                _exit(0);
+            }
+            sigset_t stop;
+            sigemptyset(&stop);
+            sigaddset(&stop, SIGTERM);
+            sigaddset(&stop, SIGINT);
+            pthread_sigmask(SIG_SETMASK, &stop, nullptr);
+
+            std::vector<int> cpus = shardCpus(shard, shards, pin);
+            if (!cpus.empty() && !pinToCpus(cpus)) {
+                std::cerr << "Warning: could not pin shard " << shard << ": " << std::strerror(errno) << std::endl;
+            }
+            int code = serve(shard);
+            std::cout.flush();
+            std::cerr.flush();
+            _exit(code);
+        }
+        pids[shard] = pid;
+        started[shard] = std::chrono::steady_clock::now();
+    };
+
+    for (size_t shard = 0; shard < shards; shard++) {
+        spawn(shard);
+    }
+    std::thread([]() {
+        std::cin.get();
+        kill(getpid(), SIGTERM);
+    }).detach();
+
+    bool stopping = false;
+    int exit_code = 0;
+    size_t running = shards;
+    auto stopAll = [&]() {
+        stopping = true;
+        for (pid_t pid : pids) {
+            if (pid > 0) kill(pid, SIGTERM);
+        }
+    };
+
+    while (running > 0) {
+        int signal;
+        sigwait(&signals, &signal);
+        if (signal != SIGCHLD) {
+            if (!stopping) stopAll();
+            continue;
+        }
+
+        pid_t pid;
+        int status;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            auto it = std::find(pids.begin(), pids.end(), pid);
+            if (it == pids.end()) {
+                continue;
+            }
+            size_t shard = it - pids.begin();
+            *it = -1;
+            running--;
+            bool clean = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            if (stopping) {
+                exit_code = clean ? exit_code : 1;
+                continue;
+            }
+
+            std::cerr << "Shard " << shard << " (pid " << pid << ") "
+                      << (WIFSIGNALED(status) ? "killed by signal " + std::to_string(WTERMSIG(status))
+                                              : "exited with status " + std::to_string(WEXITSTATUS(status)))
+                      << std::endl;
+            if (std::chrono::steady_clock::now() - started[shard] < std::chrono::seconds(kStartupGraceSeconds)) {
+                exit_code = 1;
+                stopAll();
+            } else {
+                spawn(shard);
+                running++;
+            }
+        }
+    }
+    return exit_code;
+}
+
+#endif // PROCESS_SHARDS_H
@@ -0,0 +1,253 @@
+#ifndef PROMPT_TEMPLATES_H
+#define PROMPT_TEMPLATES_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <cctype>
+#include <stdexcept>
+#include <nlohmann/json.hpp>
+
+// Append the JSON string escaping of `text` (without surrounding quotes) to `out`
+inline void appendJsonEscaped(std::string& out, const std::string& text) {
+    static const char hex[] = "0123456789abcdef";
+    for (unsigned char c : text) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    out += "\\u00";
+                    out += hex[c >> 4];
+                    out += hex[c & 0xf];
+                } else {
+                    out += static_cast<char>(c);
+                }
+        }
+    }
+}
+
+// A system prompt with optional {{variable}} placeholders. The literal text is
+// JSON-escaped once at load time into a single buffer; expanding the template
+// only copies byte ranges of that buffer and escapes the (short) variable values.
+class PromptTemplate {
+private:
+    struct Segment {
+        size_t offset;
+        size_t length;
+        std::string variable;  // empty for a literal range
+    };
+
+    std::string id;
+    std::string title;
+    std::string escaped;
+    std::vector<Segment> segments;
+    std::vector<std::string> variables;
+    size_t rawSize;
+
+public:
+    PromptTemplate(const std::string& id, const std::string& title, const std::string& text)
+        : id(id), title(title), rawSize(text.size()) {
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t open = text.find("{{", pos);
+            size_t close = open == std::string::npos ? std::string::npos : text.find("}}", open + 2);
+            size_t literalEnd = close == std::string::npos ? text.size() : open;
+
+            if (literalEnd > pos) {
+                size_t offset = escaped.size();
+                appendJsonEscaped(escaped, text.substr(pos, literalEnd - pos));
+                segments.push_back({offset, escaped.size() - offset, ""});
+            }
+            if (close == std::string::npos) {
+                break;
+            }
+
+            std::string name = text.substr(open + 2, close - open - 2);
+            segments.push_back({0, 0, name});
+            if (std::find(variables.begin(), variables.end(), name) == variables.end()) {
+                variables.push_back(name);
+            }
+            pos = close + 2;
+        }
+    }
+
+    const std::string& getId() const { return id; }
+    const std::string& getTitle() const { return title; }
+    const std::vector<std::string>& getVariables() const { return variables; }
+    size_t size() const { return rawSize; }
+    size_t escapedSize() const { return escaped.size(); }
+
+    // Append the expanded, JSON-escaped prompt (without quotes) to `out`
+    void appendEscaped(std::string& out, const std::map<std::string, std::string>& vars) const {
+        for (const Segment& segment : segments) {
+            if (segment.variable.empty()) {
+                out.append(escaped, segment.offset, segment.length);
+                continue;
+            }
+            auto it = vars.find(segment.variable);
+            if (it == vars.end()) {
+                throw std::runtime_error("Missing template variable '" + segment.variable + "' for " + id);
+            }
+            appendJsonEscaped(out, it->second);
+        }
+    }
+
+    // Expand to plain text; used where a payload is built with nlohmann::json
+    std::string expand(const std::map<std::string, std::string>& vars) const {
+        std::string out;
+        appendEscaped(out, vars);
+        return nlohmann::json::parse("\"" + out + "\"").get<std::string>();
+    }
+};
+
+// Prompt templates keyed by ID, loaded once at startup and read-only afterwards
+class PromptTemplateRegistry {
+private:
+    std::map<std::string, PromptTemplate> templates;
+
+    static std::string slugify(const std::string& title) {
+        std::string slug;
+        for (unsigned char c : title) {
+            if (std::isalnum(c)) {
+                slug += static_cast<char>(std::tolower(c));
+            } else if (!slug.empty() && slug.back() != '-') {
+                slug += '-';
+            }
+        }
+        while (!slug.empty() && slug.back() == '-') {
+            slug.pop_back();
+        }
+        return slug;
+    }
+
+    static std::string trimRight(const std::string& line) {
+        size_t end = line.find_last_not_of(" \t\r");
+        return end == std::string::npos ? "" : line.substr(0, end + 1);
+    }
+
+public:
+    // Register a template and return the ID it was stored under. An ID that is
+    // already taken, e.g. by two sections with the same title, gets a numeric
+    // suffix so the earlier template stays reachable.
+    std::string add(const std::string& id, const std::string& title, const std::string& text) {
+        std::string unique = id;
+        for (int n = 2; templates.count(unique); n++) {
+            unique = id + "-" + std::to_string(n);
+        }
+        if (unique != id) {
+            std::cerr << "Warning: duplicate prompt template ID '" << id << "' (" << title
+                      << "), registered as '" << unique << "'" << std::endl;
+        }
+        templates.emplace(unique, PromptTemplate(unique, title, text));
+        return unique;
+    }
+
+    // Load every "## Section" of a prompt library markdown file as a template.
+    // A section ends at a "---" rule, the next heading, or the first plain
+    // paragraph after its bullet list. Returns the number of templates added.
+    size_t loadMarkdown(const std::string& path) {
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            return 0;
+        }
+
+        size_t added = 0;
+        std::string title;
+        std::string body;
+        bool inBullets = false;
+
+        auto flush = [&]() {
+            if (!title.empty() && title != "Table of Contents") {
+                add(slugify(title), title, title + "\n\n" + trimRight(body));
+                added++;
+            }
+            title.clear();
+            body.clear();
+            inBullets = false;
+        };
+
+        std::string line;
+        while (std::getline(file, line)) {
+            line = trimRight(line);
+            if (line.compare(0, 3, "## ") == 0) {
+                flush();
+                title = line.substr(3);
+            } else if (line.compare(0, 2, "# ") == 0 || line == "---") {
+                flush();
+            } else if (!title.empty()) {
+                size_t indent = line.find_first_not_of(' ');
+                bool bullet = indent != std::string::npos && line.compare(indent, 2, "- ") == 0;
+                if (inBullets && !bullet && !line.empty()) {
+                    flush();
+                    continue;
+                }
+                inBullets = inBullets || bullet;
+                if (!body.empty() || !line.empty()) {
+                    body += line + "\n";
+                }
+            }
+        }
+        flush();
+        return added;
+    }
+
+    const PromptTemplate* find(const std::string& id) const {
+        auto it = templates.find(id);
+        return it == templates.end() ? nullptr : &it->second;
+    }
+
+    size_t count() const { return templates.size(); }
+
+    nlohmann::json toJson() const {
+        nlohmann::json list = nlohmann::json::array();
+        for (const auto& entry : templates) {
+            const PromptTemplate& tpl = entry.second;
+            list.push_back({
+                {"id", tpl.getId()},
+                {"title", tpl.getTitle()},
+                {"bytes", tpl.size()},
+                {"variables", tpl.getVariables()}
+            });
+        }
+        return list;
+    }
+};
+
+// Build a chat completion body by splicing the pre-escaped template into the
+// surrounding JSON. Produces the same document as serialising the equivalent
+// nlohmann::json payload; `extraMembers` (",\"name\":value" pairs, such as
+// tool definitions) are appended after the fixed fields.
+inline std::string spliceChatPayload(const std::string& model, const PromptTemplate& systemTemplate,
+                                     const std::map<std::string, std::string>& vars,
+                                     const std::string& userPrompt, double temperature,
+                                     double top_p, int max_tokens, bool stream = false,
+                                     const std::string& extraMembers = "") {
+    std::string payload;
+    payload.reserve(systemTemplate.escapedSize() + userPrompt.size() + model.size() + extraMembers.size() + 192);
+    payload += "{\"max_completion_tokens\":";
+    payload += std::to_string(max_tokens);
+    payload += ",\"messages\":[{\"content\":\"";
+    systemTemplate.appendEscaped(payload, vars);
+    payload += "\",\"role\":\"system\"},{\"content\":\"";
+    appendJsonEscaped(payload, userPrompt);
+    payload += "\",\"role\":\"user\"}],\"model\":\"";
+    appendJsonEscaped(payload, model);
+    payload += stream ? "\",\"stream\":true,\"temperature\":" : "\",\"stream\":false,\"temperature\":";
+    payload += nlohmann::json(temperature).dump();
+    payload += ",\"top_p\":";
+    payload += nlohmann::json(top_p).dump();
+    payload += extraMembers;
+    payload += "}";
+    return payload;
+}
+
+#endif // PROMPT_TEMPLATES_H
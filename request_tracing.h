@@ -0,0 +1,654 @@
+#ifndef REQUEST_TRACING_H
+#define REQUEST_TRACING_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <curl/curl.h>
+#include <nlohmann/json.hpp>
+
+// W3C trace context carried by a span: the trace it belongs to, its own span
+// ID and the trace flags (bit 0 = sampled by the caller)
+struct TraceContext {
+    uint64_t trace_hi = 0;
+    uint64_t trace_lo = 0;
+    uint64_t span_id = 0;
+    uint8_t flags = 0;
+
+    bool valid() const { return (trace_hi | trace_lo) != 0 && span_id != 0; }
+
+    static std::string hex(uint64_t value, int digits) {
+        static const char digitChars[] = "0123456789abcdef";
+        std::string out(digits, '0');
+        for (int i = digits - 1; i >= 0; i--, value >>= 4) {
+            out[i] = digitChars[value & 0xf];
+        }
+        return out;
+    }
+
+    std::string traceId() const { return hex(trace_hi, 16) + hex(trace_lo, 16); }
+
+    // "00-<trace id>-<span id>-<flags>"
+    std::string traceparent() const {
+        return "00-" + traceId() + "-" + hex(span_id, 16) + "-" + hex(flags, 2);
+    }
+
+    // Parse a traceparent header; returns an invalid context if it is malformed
+    static TraceContext parse(const std::string& header) {
+        TraceContext ctx;
+        if (header.size() < 55 || header[2] != '-' || header[35] != '-' || header[52] != '-' ||
+            header.compare(0, 2, "ff") == 0) {
+            return ctx;
+        }
+        uint64_t parts[4] = {0, 0, 0, 0};
+        const size_t offsets[4] = {3, 19, 36, 53};
+        const size_t lengths[4] = {16, 16, 16, 2};
+        for (int p = 0; p < 4; p++) {
+            for (size_t i = offsets[p]; i < offsets[p] + lengths[p]; i++) {
+                char c = header[i];
+                int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+                if (digit < 0) {
+                    return TraceContext();
+                }
+                parts[p] = (parts[p] << 4) | digit;
+            }
+        }
+        ctx.trace_hi = parts[0];
+        ctx.trace_lo = parts[1];
+        ctx.span_id = parts[2];
+        ctx.flags = static_cast<uint8_t>(parts[3]);
+        return ctx.valid() ? ctx : TraceContext();
+    }
+};
+
+enum class SpanKind : uint8_t { Internal = 1, Server = 2, Client = 3 };
+
+// One finished span. `name` must point at a string literal, since spans are
+// read back long after the code that recorded them has returned.
+struct SpanRecord {
+    uint64_t trace_hi;
+    uint64_t trace_lo;
+    uint64_t span_id;
+    uint64_t parent_id;
+    const char* name;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    int32_t status;
+    SpanKind kind;
+};
+
+// Fixed-size ring of finished spans written by a single thread. Each slot is
+// guarded by a sequence counter so the exporter can copy spans out while the
+// owner keeps writing; a slot caught mid-write is skipped.
+class SpanRing {
+public:
+    static constexpr size_t kSlots = 1024;
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> seq{0};
+        std::atomic<uint64_t> words[8];
+    };
+
+    Slot slots[kSlots];
+    uint64_t head = 0;  // touched only by the thread holding the ring
+
+public:
+    void push(const SpanRecord& span) {
+        Slot& slot = slots[head++ % kSlots];
+        uint64_t seq = slot.seq.load(std::memory_order_relaxed);
+        slot.seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.words[0].store(span.trace_hi, std::memory_order_relaxed);
+        slot.words[1].store(span.trace_lo, std::memory_order_relaxed);
+        slot.words[2].store(span.span_id, std::memory_order_relaxed);
+        slot.words[3].store(span.parent_id, std::memory_order_relaxed);
+        slot.words[4].store(reinterpret_cast<uintptr_t>(span.name), std::memory_order_relaxed);
+        slot.words[5].store(span.start_ns, std::memory_order_relaxed);
+        slot.words[6].store(span.end_ns, std::memory_order_relaxed);
+        slot.words[7].store(static_cast<uint32_t>(span.status) | static_cast<uint64_t>(span.kind) << 32,
+                            std::memory_order_relaxed);
+        slot.seq.store(seq + 2, std::memory_order_release);
+    }
+
+    // Copy this trace's spans among the most recent ones, newest first, until
+    // `wanted` are found or spans older than `since_ns` are reached. Only the
+    // thread holding the ring may call this.
+    void collectRecent(uint64_t trace_hi, uint64_t trace_lo, uint64_t since_ns, uint32_t wanted,
+                       std::vector<SpanRecord>& out) const {
+        for (uint64_t i = head, seen = 0; i > 0 && seen < kSlots && wanted > 0; i--, seen++) {
+            const Slot& slot = slots[(i - 1) % kSlots];
+            uint64_t end_ns = slot.words[6].load(std::memory_order_relaxed);
+            if (end_ns < since_ns) {
+                break;
+            }
+            if (slot.words[0].load(std::memory_order_relaxed) == trace_hi &&
+                slot.words[1].load(std::memory_order_relaxed) == trace_lo) {
+                uint64_t meta = slot.words[7].load(std::memory_order_relaxed);
+                out.push_back({trace_hi, trace_lo, slot.words[2].load(std::memory_order_relaxed),
+                               slot.words[3].load(std::memory_order_relaxed),
+                               reinterpret_cast<const char*>(slot.words[4].load(std::memory_order_relaxed)),
+                               slot.words[5].load(std::memory_order_relaxed), end_ns,
+                               static_cast<int32_t>(meta & 0xffffffff), static_cast<SpanKind>(meta >> 32)});
+                wanted--;
+            }
+        }
+    }
+
+    // Call `fn(const SpanRecord&)` for every span currently held
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        for (const Slot& slot : slots) {
+            uint64_t before = slot.seq.load(std::memory_order_acquire);
+            if (before == 0 || (before & 1)) {
+                continue;
+            }
+            uint64_t words[8];
+            for (int i = 0; i < 8; i++) {
+                words[i] = slot.words[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) != before) {
+                continue;
+            }
+            fn(SpanRecord{words[0], words[1], words[2], words[3], reinterpret_cast<const char*>(words[4]),
+                          words[5], words[6], static_cast<int32_t>(words[7] & 0xffffffff),
+                          static_cast<SpanKind>(words[7] >> 32)});
+        }
+    }
+};
+
+class Tracer;
+
+// Per-request state shared by every span of one trace, including spans on
+// batch runner threads. Lives on the stack of the thread that owns the root.
+struct TraceRoot {
+    Tracer* tracer;
+    std::atomic<bool> error{false};
+    std::atomic<uint32_t> spans{0};
+};
+
+// What a span needs to create children, possibly on another thread
+struct TraceHandle {
+    TraceRoot* root = nullptr;
+    TraceContext ctx;
+
+    bool active() const { return root != nullptr; }
+};
+
+// Collects request spans and exports the traces worth keeping. Every request
+// is recorded while tracing is on, and the keep/drop decision is made when the
+// request finishes (tail sampling): slow and failed requests are always kept,
+// along with a random fraction of the rest and any trace the caller marked as
+// sampled. Kept traces are written as OTLP/JSON, one export per line, to a
+// file or POSTed to an OTLP/HTTP collector by a background thread.
+// Exports are batched and may lag by up to kExportDelayMs.
+class Tracer {
+public:
+    enum class Mode { Off, Sample, Always };
+
+    static Mode parseMode(const std::string& name) {
+        if (name == "off") return Mode::Off;
+        if (name == "sample") return Mode::Sample;
+        if (name == "always") return Mode::Always;
+        throw std::runtime_error("Unknown trace mode: " + name + " (expected off, sample or always)");
+    }
+
+    static const char* modeName(Mode mode) {
+        return mode == Mode::Always ? "always" : mode == Mode::Sample ? "sample" : "off";
+    }
+
+    // Monotonic nanoseconds. Span times are taken on this clock, so NTP steps
+    // and manual clock changes never skew durations; they are moved onto the
+    // wall clock OTLP expects only when a trace is exported.
+    static uint64_t now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+    }
+
+    // Wall-clock time minus now(), read once per kept trace
+    static uint64_t wallOffset() {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec - now();
+    }
+
+    static uint64_t randomId() {
+        thread_local uint64_t state = std::random_device()() ^
+            (static_cast<uint64_t>(std::random_device()()) << 32) ^
+            std::hash<std::thread::id>()(std::this_thread::get_id());
+        // splitmix64
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+        return z ? z : 1;
+    }
+
+    // The span the calling thread is currently inside, if any
+    static TraceHandle& current() {
+        thread_local TraceHandle handle;
+        return handle;
+    }
+
+private:
+    // Rings outlive the threads that wrote them: a thread hands its ring
+    // back to the pool on exit and the next new thread picks it up, so the
+    // number of rings tracks peak concurrency rather than threads created.
+    struct RingPool {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<SpanRing>> rings;
+        std::vector<SpanRing*> free;
+
+        SpanRing* acquire() {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!free.empty()) {
+                SpanRing* ring = free.back();
+                free.pop_back();
+                return ring;
+            }
+            rings.emplace_back(new SpanRing());
+            return rings.back().get();
+        }
+
+        void release(SpanRing* ring) {
+            std::lock_guard<std::mutex> lock(mutex);
+            free.push_back(ring);
+        }
+    };
+
+    struct RingLease {
+        std::shared_ptr<RingPool> pool;
+        SpanRing* ring = nullptr;
+
+        ~RingLease() {
+            if (pool) pool->release(ring);
+        }
+    };
+
+    struct KeptTrace {
+        uint64_t trace_hi;
+        uint64_t trace_lo;
+        uint32_t spans;
+        std::vector<SpanRecord> collected;  // spans copied from the root thread's ring
+        uint64_t wall_offset;               // wall clock minus Tracer::now() when the trace ended
+    };
+
+    // Kept traces are exported in batches, like an OTLP batch span processor
+    static constexpr size_t kExportBatch = 256;
+    static constexpr int kExportDelayMs = 500;
+
+    std::shared_ptr<RingPool> pool;
+    std::atomic<Mode> mode;
+    std::atomic<uint64_t> slow_ns;
+    std::atomic<double> sample_ratio;
+
+    std::mutex pending_mutex;
+    std::condition_variable pending_cond;
+    std::vector<KeptTrace> pending;
+    std::string destination;
+    bool exporting;
+    std::thread export_thread;
+
+    std::atomic<uint64_t> traced{0};
+    std::atomic<uint64_t> kept{0};
+    std::atomic<uint64_t> exported_spans{0};
+    std::atomic<uint64_t> incomplete{0};
+    std::atomic<uint64_t> export_errors{0};
+
+    SpanRing& localRing() {
+        thread_local RingLease lease;
+        if (lease.pool != pool) {
+            if (lease.pool) lease.pool->release(lease.ring);
+            lease.pool = pool;
+            lease.ring = pool->acquire();
+        }
+        return *lease.ring;
+    }
+
+    // Append one span as an OTLP/JSON object, with its monotonic times moved
+    // onto the wall clock by `wall_offset`. Span names are fixed literals
+    // that need no escaping, so the document is assembled directly.
+    static void appendOtlpSpan(std::string& out, const SpanRecord& span, uint64_t wall_offset) {
+        out += "{\"traceId\":\"";
+        out += TraceContext::hex(span.trace_hi, 16);
+        out += TraceContext::hex(span.trace_lo, 16);
+        out += "\",\"spanId\":\"";
+        out += TraceContext::hex(span.span_id, 16);
+        if (span.parent_id) {
+            out += "\",\"parentSpanId\":\"";
+            out += TraceContext::hex(span.parent_id, 16);
+        }
+        out += "\",\"name\":\"";
+        out += span.name;
+        out += "\",\"kind\":";
+        out += std::to_string(static_cast<int>(span.kind));
+        out += ",\"startTimeUnixNano\":\"";
+        out += std::to_string(span.start_ns + wall_offset);
+        out += "\",\"endTimeUnixNano\":\"";
+        out += std::to_string(span.end_ns + wall_offset);
+        out += "\"";
+        if (span.status > 0) {
+            out += ",\"attributes\":[{\"key\":\"http.response.status_code\",\"value\":{\"intValue\":\"";
+            out += std::to_string(span.status);
+            out += "\"}}]";
+        }
+        if (span.status < 0 || span.status >= 500) {
+            out += ",\"status\":{\"code\":2}";
+        }
+        out += "}";
+    }
+
+    // Gather the spans of `batch` and hand them to the destination. Spans
+    // recorded on other threads (batch items) are found by scanning every ring.
+    void exportTraces(std::vector<KeptTrace>& batch, CURL* curl, std::ofstream& file) {
+        std::vector<KeptTrace*> partial;
+        for (KeptTrace& trace : batch) {
+            if (trace.collected.size() < trace.spans) {
+                partial.push_back(&trace);
+            }
+        }
+        if (!partial.empty()) {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            for (const auto& ring : pool->rings) {
+                ring->forEach([&](const SpanRecord& span) {
+                    for (KeptTrace* trace : partial) {
+                        if (span.trace_hi == trace->trace_hi && span.trace_lo == trace->trace_lo &&
+                            std::none_of(trace->collected.begin(), trace->collected.end(),
+                                         [&](const SpanRecord& s) { return s.span_id == span.span_id; })) {
+                            trace->collected.push_back(span);
+                            break;
+                        }
+                    }
+                });
+            }
+        }
+
+        size_t span_count = 0;
+        for (const KeptTrace& trace : batch) {
+            if (trace.collected.size() < trace.spans) {
+                incomplete.fetch_add(1, std::memory_order_relaxed);
+            }
+            span_count += trace.collected.size();
+        }
+        if (span_count == 0) {
+            return;
+        }
+
+        std::string body;
+        body.reserve(span_count * 320 + 256);
+        body += "{\"resourceSpans\":[{\"resource\":{\"attributes\":[{\"key\":\"service.name\","
+                "\"value\":{\"stringValue\":\"cerebras_server\"}}]},"
+                "\"scopeSpans\":[{\"scope\":{\"name\":\"cerebras_server\"},\"spans\":[";
+        bool first = true;
+        for (const KeptTrace& trace : batch) {
+            for (const SpanRecord& span : trace.collected) {
+                if (!first) body += ",";
+                first = false;
+                appendOtlpSpan(body, span, trace.wall_offset);
+            }
+        }
+        body += "]}]}]}";
+
+        bool ok;
+        if (curl) {
+            struct curl_slist* headers = curl_slist_append(NULL, "Content-Type: application/json");
+            curl_easy_setopt(curl, CURLOPT_URL, destination.c_str());
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
+            long status = 0;
+            ok = curl_easy_perform(curl) == CURLE_OK &&
+                 curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status) == CURLE_OK && status / 100 == 2;
+            curl_slist_free_all(headers);
+        } else {
+            if (!file.is_open()) {
+                file.open(destination, std::ios::app);
+            }
+            file << body << "\n" << std::flush;
+            ok = static_cast<bool>(file);
+        }
+        if (ok) {
+            exported_spans.fetch_add(span_count, std::memory_order_relaxed);
+        } else {
+            export_errors.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    static size_t discardBody(void*, size_t size, size_t nmemb, void*) {
+        return size * nmemb;
+    }
+
+    void exportLoop() {
+        bool http = destination.compare(0, 7, "http://") == 0 || destination.compare(0, 8, "https://") == 0;
+        CURL* curl = http ? curl_easy_init() : nullptr;
+        if (curl) {
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discardBody);
+        }
+
+        std::ofstream file;
+        std::unique_lock<std::mutex> lock(pending_mutex);
+        while (exporting || !pending.empty()) {
+            pending_cond.wait_for(lock, std::chrono::milliseconds(kExportDelayMs), [this]() {
+                return !exporting || pending.size() >= kExportBatch;
+            });
+            if (pending.empty()) {
+                continue;
+            }
+            std::vector<KeptTrace> batch;
+            batch.swap(pending);
+            lock.unlock();
+            exportTraces(batch, curl, file);
+            lock.lock();
+        }
+
+        if (curl) {
+            curl_easy_cleanup(curl);
+        }
+    }
+
+public:
+    Tracer() : pool(std::make_shared<RingPool>()), mode(Mode::Off), slow_ns(1000000000ULL),
+               sample_ratio(0.0), exporting(false) {}
+
+    ~Tracer() {
+        stopExporter();
+    }
+
+    void configure(Mode new_mode, uint64_t slow_ms, double ratio) {
+        slow_ns.store(slow_ms * 1000000ULL, std::memory_order_relaxed);
+        sample_ratio.store(ratio, std::memory_order_relaxed);
+        mode.store(new_mode, std::memory_order_relaxed);
+    }
+
+    Mode currentMode() const { return mode.load(std::memory_order_relaxed); }
+
+    // Start exporting kept traces to a file path or an http(s):// OTLP endpoint
+    void startExporter(const std::string& dest) {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        if (exporting) return;
+        destination = dest;
+        exporting = true;
+        export_thread = std::thread(&Tracer::exportLoop, this);
+    }
+
+    // Flush traces already kept, then stop the export thread
+    void stopExporter() {
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            exporting = false;
+        }
+        pending_cond.notify_one();
+        if (export_thread.joinable()) {
+            export_thread.join();
+        }
+    }
+
+    void record(const SpanRecord& span) {
+        localRing().push(span);
+    }
+
+    // Tail-sampling decision for a finished root span
+    bool shouldKeep(const TraceContext& ctx, uint64_t duration_ns, bool error) {
+        Mode m = currentMode();
+        if (m == Mode::Always || error || (ctx.flags & 1) ||
+            duration_ns >= slow_ns.load(std::memory_order_relaxed)) {
+            return true;
+        }
+        double ratio = sample_ratio.load(std::memory_order_relaxed);
+        return ratio > 0 && (randomId() >> 11) * (1.0 / 9007199254740992.0) < ratio;
+    }
+
+    // Called on the root's thread once its span is recorded. A kept trace's
+    // spans on this thread are copied out now, before the ring can wrap.
+    void finishTrace(const TraceContext& ctx, uint64_t start_ns, uint32_t spans, bool keep) {
+        traced.fetch_add(1, std::memory_order_relaxed);
+        if (!keep) return;
+        kept.fetch_add(1, std::memory_order_relaxed);
+
+        KeptTrace trace{ctx.trace_hi, ctx.trace_lo, spans, {}, wallOffset()};
+        trace.collected.reserve(spans);
+        localRing().collectRecent(ctx.trace_hi, ctx.trace_lo, start_ns, spans, trace.collected);
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        if (!exporting) return;
+        pending.push_back(std::move(trace));
+        if (pending.size() == kExportBatch) {
+            pending_cond.notify_one();
+        }
+    }
+
+    nlohmann::json toJson() const {
+        return {
+            {"mode", modeName(currentMode())},
+            {"slow_ms", slow_ns.load(std::memory_order_relaxed) / 1000000},
+            {"sample_ratio", sample_ratio.load(std::memory_order_relaxed)},
+            {"traced", traced.load(std::memory_order_relaxed)},
+            {"kept", kept.load(std::memory_order_relaxed)},
+            {"exported_spans", exported_spans.load(std::memory_order_relaxed)},
+            {"incomplete", incomplete.load(std::memory_order_relaxed)},
+            {"export_errors", export_errors.load(std::memory_order_relaxed)}
+        };
+    }
+};
+
+// A timed span, child of `parent`. While it is alive it is the calling
+// thread's current span, so nested spans and the upstream traceparent pick it
+// up without it being passed around. Does nothing when `parent` is inactive.
+class Span {
+protected:
+    TraceHandle handle;
+    TraceHandle saved;
+    uint64_t parent_id;
+    const char* name;
+    uint64_t start_ns;
+    int32_t status;
+    SpanKind kind;
+
+    Span() : parent_id(0), name(nullptr), start_ns(0), status(0), kind(SpanKind::Internal) {}
+
+    void enter() {
+        saved = Tracer::current();
+        Tracer::current() = handle;
+        start_ns = Tracer::now();
+    }
+
+public:
+    Span(const TraceHandle& parent, const char* name, SpanKind kind = SpanKind::Internal)
+        : parent_id(parent.ctx.span_id), name(name), start_ns(0), status(0), kind(kind) {
+        if (!parent.active()) return;
+        handle = parent;
+        handle.ctx.span_id = Tracer::randomId();
+        enter();
+    }
+
+    explicit Span(const char* name, SpanKind kind = SpanKind::Internal) : Span(Tracer::current(), name, kind) {}
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+    ~Span() {
+        end();
+    }
+
+    bool active() const { return handle.active(); }
+    const TraceContext& context() const { return handle.ctx; }
+
+    // HTTP status, or -1 for a failure without one; 5xx and -1 mark the trace as failed
+    void setStatus(int code) {
+        status = code;
+        if (handle.active() && (code < 0 || code >= 500)) {
+            handle.root->error.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    // Record a span of this trace that has already finished, as a child of this one
+    void child(const char* child_name, uint64_t child_start, uint64_t child_end, int child_status = 0) const {
+        if (!handle.active()) return;
+        handle.root->spans.fetch_add(1, std::memory_order_relaxed);
+        handle.root->tracer->record({handle.ctx.trace_hi, handle.ctx.trace_lo, Tracer::randomId(), handle.ctx.span_id,
+                                     child_name, child_start, child_end, child_status, SpanKind::Internal});
+    }
+
+    void end() {
+        if (!handle.active()) return;
+        handle.root->spans.fetch_add(1, std::memory_order_relaxed);
+        handle.root->tracer->record({handle.ctx.trace_hi, handle.ctx.trace_lo, handle.ctx.span_id, parent_id,
+                                     name, start_ns, Tracer::now(), status, kind});
+        Tracer::current() = saved;
+        handle.root = nullptr;
+    }
+};
+
+// The server span of one request. Continues the caller's trace when the
+// request carries a valid traceparent, and makes the sampling decision when
+// it ends. `start_ns` may predate construction so queueing is included.
+class RequestTrace : public Span {
+private:
+    TraceRoot root;
+
+public:
+    RequestTrace(Tracer& tracer, const std::string& traceparent, const char* route, uint64_t start)
+        : root{&tracer} {
+        if (tracer.currentMode() == Tracer::Mode::Off) return;
+        TraceContext caller = TraceContext::parse(traceparent);
+        handle.root = &root;
+        handle.ctx = caller;
+        if (!caller.valid()) {
+            handle.ctx.trace_hi = Tracer::randomId();
+            handle.ctx.trace_lo = Tracer::randomId();
+        }
+        parent_id = caller.valid() ? caller.span_id : 0;
+        handle.ctx.span_id = Tracer::randomId();
+        if (tracer.currentMode() == Tracer::Mode::Always) {
+            handle.ctx.flags |= 1;
+        }
+        name = route;
+        kind = SpanKind::Server;
+        enter();
+        start_ns = start;
+    }
+
+    ~RequestTrace() {
+        if (!handle.active()) return;
+        TraceContext ctx = handle.ctx;
+        uint64_t start = start_ns;
+        uint64_t duration = Tracer::now() - start;
+        end();
+        bool error = root.error.load(std::memory_order_relaxed);
+        root.tracer->finishTrace(ctx, start, root.spans.load(std::memory_order_relaxed),
+                                 root.tracer->shouldKeep(ctx, duration, error));
+    }
+};
+
+#endif // REQUEST_TRACING_H
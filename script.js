@@ -6,6 +6,9 @@ document.addEventListener('DOMContentLoaded', () => {
     const modelSelect = document.getElementById('model-select');
     const systemPrompt = document.getElementById('system-prompt');
     const cliPromptButton = document.getElementById('cli-prompt-button');
+    const templateSelect = document.getElementById('template-select');
+    const templateVars = document.getElementById('template-vars');
+    const templateVariables = {};
 
     // Recommended CLI system prompt
     const CLI_SYSTEM_PROMPT = `You are a CLI assistant powered by Qwen3, running on Cerebras infrastructure. Your role is to process and execute user commands directly, returning results in a clear, concise, and machine-readable format. Follow these guidelines:
@@ -64,6 +67,120 @@ document.addEventListener('DOMContentLoaded', () => {
         }, 3000);
     });
 
+    // Usage & throughput panel, polled only while it is open
+    const statsPanel = document.getElementById('stats-panel');
+    const statsSummary = document.getElementById('stats-summary');
+    const statsModels = document.getElementById('stats-models');
+    const CLAIMED_TOKENS_PER_SECOND = 2400;
+    const STATS_POLL_INTERVAL_MS = 5000;
+    let statsTimer = null;
+
+    statsPanel.addEventListener('toggle', () => {
+        if (statsPanel.open) {
+            refreshStats();
+            statsTimer = setInterval(refreshStats, STATS_POLL_INTERVAL_MS);
+        } else {
+            clearInterval(statsTimer);
+            statsTimer = null;
+        }
+    });
+
+    async function refreshStats() {
+        try {
+            const response = await fetch('/api/stats', { cache: 'no-store' });
+            if (!response.ok) {
+                throw new Error(`HTTP error! status: ${response.status}`);
+            }
+            renderStats(await response.json());
+        } catch (error) {
+            statsSummary.textContent = `Stats unavailable: ${error.message}`;
+        }
+    }
+
+    function renderStats(stats) {
+        const total = stats.total;
+        // The newest window is only the last minute if it is the server's current one
+        const newest = stats.windows.length > 0 ? stats.windows[stats.windows.length - 1] : null;
+        const lastMinute = newest && newest.minute === stats.current_minute ? newest : null;
+        const rate = total.tokens_per_second;
+        const percent = Math.round(rate / CLAIMED_TOKENS_PER_SECOND * 100);
+
+        statsSummary.textContent =
+            `${total.requests} requests (${total.errors} errors) · ` +
+            `${total.prompt_tokens + total.completion_tokens} tokens · ` +
+            `${Math.round(rate)} tok/s (${percent}% of ${CLAIMED_TOKENS_PER_SECOND}) · ` +
+            `last minute: ${lastMinute ? lastMinute.requests : 0} requests`;
+
+        const speculation = stats.speculation;
+        if (speculation && speculation.enabled) {
+            statsSummary.textContent +=
+                ` · prefetch: ${speculation.hits}/${speculation.issued} served ` +
+                `(${Math.round(speculation.hit_rate * 100)}% hit rate), ` +
+                `${speculation.tokens_wasted} tokens wasted`;
+        }
+
+        statsModels.innerHTML = '';
+        for (const [model, counters] of Object.entries(stats.models)) {
+            const row = document.createElement('tr');
+            const cells = [
+                model,
+                counters.requests,
+                counters.prompt_tokens,
+                counters.completion_tokens,
+                Math.round(counters.tokens_per_second),
+                `${Math.round(counters.avg_latency_ms)} ms`
+            ];
+            for (const value of cells) {
+                const cell = document.createElement('td');
+                cell.textContent = value;
+                row.appendChild(cell);
+            }
+            statsModels.appendChild(row);
+        }
+    }
+
+    // Server-side prompt templates are referenced by ID, so their text is never re-sent
+    async function loadTemplates() {
+        try {
+            const response = await fetch('/api/templates');
+            if (!response.ok) return;
+            const templates = await response.json();
+            for (const template of templates) {
+                const option = document.createElement('option');
+                option.value = template.id;
+                option.textContent = template.title;
+                templateSelect.appendChild(option);
+                templateVariables[template.id] = template.variables || [];
+            }
+        } catch (error) {
+            console.error('Error loading templates:', error);
+        }
+    }
+
+    // One input per {{variable}} of the selected template, sent as template_vars
+    templateSelect.addEventListener('change', () => {
+        systemPrompt.disabled = templateSelect.value !== '';
+        templateVars.replaceChildren();
+        const variables = templateVariables[templateSelect.value] || [];
+        for (const name of variables) {
+            const setting = document.createElement('div');
+            setting.className = 'setting';
+            const label = document.createElement('label');
+            label.htmlFor = `template-var-${name}`;
+            label.textContent = `${name}:`;
+            const input = document.createElement('input');
+            input.type = 'text';
+            input.id = `template-var-${name}`;
+            input.dataset.variable = name;
+            setting.appendChild(label);
+            setting.appendChild(input);
+            templateVars.appendChild(setting);
+        }
+        templateVars.hidden = variables.length === 0;
+    });
+
+    loadTemplates();
+
     // Initialize with a welcome message
     addMessage('assistant', 'Welcome to our peaceful space for conversation. I\'m here to listen and support you in whatever way feels most helpful. Take your time, and share what\'s on your mind when you\'re ready.');
 
@@ -152,6 +269,19 @@ document.addEventListener('DOMContentLoaded', () => {
             // Get selected model and system prompt
             const model = modelSelect.value;
             const system = systemPrompt.value;
+            const request = { model: model, user_prompt: message };
+            if (templateSelect.value) {
+                request.system_template = templateSelect.value;
+                const inputs = templateVars.querySelectorAll('input[data-variable]');
+                if (inputs.length > 0) {
+                    request.template_vars = {};
+                    for (const input of inputs) {
+                        request.template_vars[input.dataset.variable] = input.value;
+                    }
+                }
+            } else {
+                request.system_prompt = system;
+            }
 
             // Send request to server
             const response = await fetch('/api/chat', {
@@ -159,11 +289,7 @@ document.addEventListener('DOMContentLoaded', () => {
                 headers: {
                     'Content-Type': 'application/json'
                 },
-                body: JSON.stringify({
-                    model: model,
-                    system_prompt: system,
-                    user_prompt: message
-                })
+                body: JSON.stringify(request)
             });
 
             if (!response.ok) {
@@ -0,0 +1,328 @@
+#ifndef SERVER_CONFIG_H
+#define SERVER_CONFIG_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <nlohmann/json.hpp>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+// Runtime settings for cerebras_server. A snapshot is immutable once
+// published; changes are made by building a new snapshot and swapping it in.
+struct ServerConfig {
+    std::vector<std::string> api_keys;       // used round-robin, one per upstream request
+    std::string upstream_url = "https://api.cerebras.ai/v1/chat/completions";
+    std::vector<std::string> allowed_models; // empty allows any model
+    std::string default_model = "qwen-3-32b";
+    double temperature = 0.7;
+    double top_p = 0.95;
+    int max_tokens = 16382;
+    size_t workers = 4;
+    size_t max_request_bytes = 8 * 1024 * 1024;
+    size_t max_batch_size = 64;
+    size_t batch_concurrency = 4;
+    size_t max_batch_concurrency = 16;
+    size_t max_batch_inflight = 32;          // batch items running upstream at once, over all batches
+    std::string trace_mode = "off";          // off, sample (tail-based) or always
+    uint64_t trace_slow_ms = 1000;           // requests at least this slow are always kept
+    double trace_sample_ratio = 0.0;         // fraction of other requests kept when sampling
+    bool speculation_enabled = false;        // prefetch predicted follow-up template requests
+    std::vector<std::vector<std::string>> speculation_sequences;  // template IDs, in step order
+    bool speculation_learn = true;           // also predict from observed template transitions
+    double speculation_min_confidence = 0.6;
+    uint64_t speculation_min_observations = 3;
+    size_t speculation_max_inflight = 2;
+    uint64_t speculation_tokens_per_minute = 20000;
+    uint64_t speculation_ttl_seconds = 300;
+    std::string schema_validation = "incremental";  // tool call / JSON output checks: incremental, final or off
+    bool cache_enabled = false;              // answer repeated identical /api/chat requests from the shared cache
+    uint64_t cache_ttl_seconds = 300;
+    uint64_t rate_limit_per_minute = 0;      // per client, across all processes; 0 disables rate limiting
+    uint64_t rate_limit_burst = 10;
+    uint64_t version = 0;
+
+    bool modelAllowed(const std::string& model) const {
+        return allowed_models.empty() ||
+               std::find(allowed_models.begin(), allowed_models.end(), model) != allowed_models.end();
+    }
+
+    // Built-in defaults, with the API key and upstream taken from the environment
+    static ServerConfig fromEnvironment() {
+        ServerConfig config;
+        if (const char* key = std::getenv("CEREBRAS_API_KEY")) {
+            config.api_keys.push_back(key);
+        }
+        if (const char* url = std::getenv("CEREBRAS_API_URL")) {
+            config.upstream_url = url;
+        }
+        return config;
+    }
+
+    // Overlay the settings present in a config document onto `base`. Throws on
+    // malformed values so that a bad edit never replaces a working snapshot.
+    static ServerConfig fromJson(const nlohmann::json& doc, ServerConfig base) {
+        if (doc.contains("api_keys")) base.api_keys = doc["api_keys"].get<std::vector<std::string>>();
+        if (doc.contains("upstream_url")) base.upstream_url = doc["upstream_url"].get<std::string>();
+        if (doc.contains("allowed_models")) base.allowed_models = doc["allowed_models"].get<std::vector<std::string>>();
+        if (doc.contains("workers")) base.workers = doc["workers"].get<size_t>();
+
+        if (doc.contains("defaults")) {
+            const nlohmann::json& defaults = doc["defaults"];
+            base.default_model = defaults.value("model", base.default_model);
+            base.temperature = defaults.value("temperature", base.temperature);
+            base.top_p = defaults.value("top_p", base.top_p);
+            base.max_tokens = defaults.value("max_tokens", base.max_tokens);
+        }
+        if (doc.contains("limits")) {
+            const nlohmann::json& limits = doc["limits"];
+            base.max_request_bytes = limits.value("max_request_bytes", base.max_request_bytes);
+            base.max_batch_size = limits.value("max_batch_size", base.max_batch_size);
+            base.batch_concurrency = limits.value("batch_concurrency", base.batch_concurrency);
+            base.max_batch_concurrency = limits.value("max_batch_concurrency", base.max_batch_concurrency);
+            base.max_batch_inflight = limits.value("max_batch_inflight", base.max_batch_inflight);
+        }
+        if (doc.contains("tracing")) {
+            const nlohmann::json& tracing = doc["tracing"];
+            base.trace_mode = tracing.value("mode", base.trace_mode);
+            base.trace_slow_ms = tracing.value("slow_ms", base.trace_slow_ms);
+            base.trace_sample_ratio = tracing.value("sample_ratio", base.trace_sample_ratio);
+        }
+        if (doc.contains("speculation")) {
+            const nlohmann::json& speculation = doc["speculation"];
+            base.speculation_enabled = speculation.value("enabled", base.speculation_enabled);
+            base.speculation_sequences = speculation.value("sequences", base.speculation_sequences);
+            base.speculation_learn = speculation.value("learn", base.speculation_learn);
+            base.speculation_min_confidence = speculation.value("min_confidence", base.speculation_min_confidence);
+            base.speculation_min_observations = speculation.value("min_observations", base.speculation_min_observations);
+            base.speculation_max_inflight = speculation.value("max_inflight", base.speculation_max_inflight);
+            base.speculation_tokens_per_minute = speculation.value("tokens_per_minute", base.speculation_tokens_per_minute);
+            base.speculation_ttl_seconds = speculation.value("ttl_seconds", base.speculation_ttl_seconds);
+        }
+        if (doc.contains("structured_output")) {
+            base.schema_validation = doc["structured_output"].value("validation", base.schema_validation);
+        }
+        if (doc.contains("response_cache")) {
+            const nlohmann::json& cache = doc["response_cache"];
+            base.cache_enabled = cache.value("enabled", base.cache_enabled);
+            base.cache_ttl_seconds = cache.value("ttl_seconds", base.cache_ttl_seconds);
+        }
+        if (doc.contains("rate_limit")) {
+            const nlohmann::json& rate_limit = doc["rate_limit"];
+            base.rate_limit_per_minute = rate_limit.value("requests_per_minute", base.rate_limit_per_minute);
+            base.rate_limit_burst = rate_limit.value("burst", base.rate_limit_burst);
+        }
+
+        if (base.workers == 0 || base.workers > 256) {
+            throw std::runtime_error("workers must be between 1 and 256");
+        }
+        if (base.max_batch_concurrency == 0 || base.batch_concurrency == 0 || base.max_batch_inflight == 0) {
+            throw std::runtime_error("batch concurrency limits must be positive");
+        }
+        if (base.trace_mode != "off" && base.trace_mode != "sample" && base.trace_mode != "always") {
+            throw std::runtime_error("tracing.mode must be off, sample or always");
+        }
+        if (base.trace_sample_ratio < 0 || base.trace_sample_ratio > 1) {
+            throw std::runtime_error("tracing.sample_ratio must be between 0 and 1");
+        }
+        if (base.speculation_min_confidence < 0 || base.speculation_min_confidence > 1) {
+            throw std::runtime_error("speculation.min_confidence must be between 0 and 1");
+        }
+        if (base.schema_validation != "incremental" && base.schema_validation != "final" &&
+            base.schema_validation != "off") {
+            throw std::runtime_error("structured_output.validation must be incremental, final or off");
+        }
+        if (base.rate_limit_per_minute > 1000000) {
+            throw std::runtime_error("rate_limit.requests_per_minute must be at most 1000000");
+        }
+        if (base.rate_limit_burst == 0 || base.rate_limit_burst > 10000) {
+            throw std::runtime_error("rate_limit.burst must be between 1 and 10000");
+        }
+        return base;
+    }
+
+    static ServerConfig fromFile(const std::string& path, const ServerConfig& base) {
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            throw std::runtime_error("Could not open config file " + path);
+        }
+        return fromJson(nlohmann::json::parse(file), base);
+    }
+};
+
+// Publishes ServerConfig snapshots RCU-style. Writers swap in a new
+// shared_ptr; readers keep a per-thread copy of the latest snapshot and only
+// re-fetch it when the published version changes, so the read path is one
+// acquire load with no locks taken and no reference count touched.
+class ConfigStore {
+private:
+    std::shared_ptr<const ServerConfig> current;
+    std::atomic<uint64_t> version;
+    std::mutex write_mutex;
+    const uint64_t generation;  // tells stores apart even when one reuses another's address
+
+    struct ThreadCache {
+        uint64_t generation = 0;
+        uint64_t version = 0;
+        std::shared_ptr<const ServerConfig> snapshot;
+    };
+
+    static uint64_t nextGeneration() {
+        static std::atomic<uint64_t> generations{0};
+        return generations.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+public:
+    explicit ConfigStore(ServerConfig initial) : version(0), generation(nextGeneration()) {
+        publish(std::move(initial));
+    }
+
+    // Replace the published snapshot; returns its version
+    uint64_t publish(ServerConfig config) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        uint64_t next = version.load(std::memory_order_relaxed) + 1;
+        config.version = next;
+        std::atomic_store(&current, std::shared_ptr<const ServerConfig>(
+            std::make_shared<const ServerConfig>(std::move(config))));
+        version.store(next, std::memory_order_release);
+        return next;
+    }
+
+    // Latest snapshot, as this thread's cached pointer. The reference stays
+    // valid until the same thread calls snapshot() again, which may replace
+    // it, so a request that must see one configuration throughout copies the
+    // shared_ptr once and reads its fields through that copy.
+    const std::shared_ptr<const ServerConfig>& snapshot() const {
+        thread_local ThreadCache cache;
+        uint64_t published = version.load(std::memory_order_acquire);
+        if (cache.generation != generation || cache.version != published) {
+            cache.snapshot = std::atomic_load(&current);
+            cache.generation = generation;
+            cache.version = cache.snapshot->version;
+        }
+        return cache.snapshot;
+    }
+
+    uint64_t currentVersion() const {
+        return version.load(std::memory_order_acquire);
+    }
+};
+
+// Watches a config file and reloads it into a ConfigStore whenever it is
+// written or replaced. Uses inotify on the parent directory (so editors that
+// save via rename are seen) and falls back to polling the mtime elsewhere.
+class ConfigWatcher {
+private:
+    std::string path;
+    ServerConfig base;
+    ConfigStore& store;
+    std::function<void(const ServerConfig&)> on_reload;
+    std::atomic<bool> running;
+    std::thread watch_thread;
+
+    void reload() {
+        try {
+            ServerConfig config = ServerConfig::fromFile(path, base);
+            store.publish(config);
+            std::cout << "Reloaded config from " << path << " (version " << store.currentVersion() << ")" << std::endl;
+            if (on_reload) {
+                // Held by value, since the callback may take snapshots of its own
+                std::shared_ptr<const ServerConfig> published = store.snapshot();
+                on_reload(*published);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Keeping previous config, reload of " << path << " failed: " << e.what() << std::endl;
+        }
+    }
+
+    static time_t modifiedTime(const std::string& file) {
+        struct stat st;
+        return stat(file.c_str(), &st) == 0 ? st.st_mtime : 0;
+    }
+
+    void pollLoop() {
+        time_t last = modifiedTime(path);
+        while (running) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            time_t now = modifiedTime(path);
+            if (now != 0 && now != last) {
+                last = now;
+                reload();
+            }
+        }
+    }
+
+#ifdef __linux__
+    void inotifyLoop() {
+        size_t slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+        std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+
+        int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            if (fd >= 0) close(fd);
+            pollLoop();
+            return;
+        }
+
+        alignas(struct inotify_event) char buffer[4096];
+        while (running) {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            if (poll(&pfd, 1, 200) <= 0) {
+                continue;
+            }
+
+            bool changed = false;
+            ssize_t len;
+            while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+                for (char* p = buffer; p < buffer + len; ) {
+                    auto* event = reinterpret_cast<struct inotify_event*>(p);
+                    if (event->len > 0 && name == event->name) {
+                        changed = true;
+                    }
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+            if (changed) {
+                reload();
+            }
+        }
+        close(fd);
+    }
+#endif
+
+public:
+    ConfigWatcher(const std::string& path, const ServerConfig& base, ConfigStore& store,
+                  std::function<void(const ServerConfig&)> on_reload = nullptr)
+        : path(path), base(base), store(store), on_reload(std::move(on_reload)), running(true) {
+#ifdef __linux__
+        watch_thread = std::thread(&ConfigWatcher::inotifyLoop, this);
+#else
+        watch_thread = std::thread(&ConfigWatcher::pollLoop, this);
+#endif
+    }
+
+    ~ConfigWatcher() {
+        running = false;
+        if (watch_thread.joinable()) {
+            watch_thread.join();
+        }
+    }
+};
+
+#endif // SERVER_CONFIG_H
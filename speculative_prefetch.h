@@ -0,0 +1,240 @@
+#ifndef SPECULATIVE_PREFETCH_H
+#define SPECULATIVE_PREFETCH_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <nlohmann/json.hpp>
+
+// Which system template users run after which. Users walking a prompt library
+// step by step send the same problem text with the next section's template,
+// so a transition is counted only when a client's consecutive requests share
+// their user prompt and template variables.
+class TransitionModel {
+private:
+    static constexpr size_t kMaxClients = 4096;
+    static constexpr int kStepWindowMinutes = 30;
+
+    struct LastStep {
+        std::string template_id;
+        std::string input;
+        std::chrono::steady_clock::time_point at;
+    };
+
+    mutable std::mutex mutex;
+    std::map<std::string, std::map<std::string, uint64_t>> counts;
+    std::unordered_map<std::string, LastStep> last_by_client;
+
+public:
+    void observe(const std::string& client, const std::string& template_id, const std::string& input) {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = last_by_client.find(client);
+        if (it != last_by_client.end()) {
+            const LastStep& last = it->second;
+            if (last.input == input && last.template_id != template_id &&
+                now - last.at < std::chrono::minutes(kStepWindowMinutes)) {
+                counts[last.template_id][template_id]++;
+            }
+        } else if (last_by_client.size() >= kMaxClients) {
+            last_by_client.clear();
+        }
+        last_by_client[client] = {template_id, input, now};
+    }
+
+    // The template most likely to follow `from`, or "" if none is likely
+    // enough. A configured sequence always wins over learned counts.
+    std::string predict(const std::string& from, const std::vector<std::vector<std::string>>& sequences,
+                        bool use_learned, double min_confidence, uint64_t min_observations) const {
+        for (const auto& sequence : sequences) {
+            auto step = std::find(sequence.begin(), sequence.end(), from);
+            if (step != sequence.end() && step + 1 != sequence.end()) {
+                return *(step + 1);
+            }
+        }
+        if (!use_learned) {
+            return "";
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = counts.find(from);
+        if (it == counts.end()) {
+            return "";
+        }
+        uint64_t total = 0;
+        const std::pair<const std::string, uint64_t>* best = nullptr;
+        for (const auto& next : it->second) {
+            total += next.second;
+            if (!best || next.second > best->second) {
+                best = &next;
+            }
+        }
+        if (!best || best->second < min_observations ||
+            static_cast<double>(best->second) / total < min_confidence) {
+            return "";
+        }
+        return best->first;
+    }
+
+    nlohmann::json toJson() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counts;
+    }
+};
+
+// Responses fetched ahead of the request that is predicted to need them.
+// Each entry is served at most once; a request that arrives while its entry
+// is still in flight waits for it instead of issuing a second upstream call.
+// Entries nobody asked for within the TTL are dropped and their tokens are
+// counted as wasted.
+class SpeculationCache {
+private:
+    struct Entry {
+        bool ready = false;
+        bool ok = false;
+        std::string body;
+        uint64_t tokens = 0;
+        std::chrono::steady_clock::time_point created;
+    };
+
+    mutable std::mutex mutex;
+    std::condition_variable ready_cond;
+    std::unordered_map<std::string, std::shared_ptr<Entry>> entries;
+
+    int64_t budget_minute = -1;
+    uint64_t budget_spent = 0;
+
+    uint64_t issued = 0;
+    uint64_t hits = 0;
+    uint64_t inflight_hits = 0;
+    uint64_t failed = 0;
+    uint64_t expired = 0;
+    uint64_t tokens_spent = 0;
+    uint64_t tokens_used = 0;
+    uint64_t tokens_wasted = 0;
+    std::atomic<uint64_t> skipped_busy{0};
+    std::atomic<uint64_t> skipped_budget{0};
+
+    static int64_t currentMinute() {
+        return std::chrono::duration_cast<std::chrono::minutes>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    // Claim `key` for a speculative request. Fails when the key is already
+    // cached or in flight, or when this minute's token budget is used up.
+    bool reserve(const std::string& key, uint64_t tokens_per_minute) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (entries.count(key)) {
+            return false;
+        }
+        int64_t minute = currentMinute();
+        if (minute != budget_minute) {
+            budget_minute = minute;
+            budget_spent = 0;
+        }
+        if (budget_spent >= tokens_per_minute) {
+            skipped_budget.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        auto entry = std::make_shared<Entry>();
+        entry->created = std::chrono::steady_clock::now();
+        entries.emplace(key, entry);
+        issued++;
+        return true;
+    }
+
+    void complete(const std::string& key, bool ok, const std::string& body, uint64_t tokens) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            budget_spent += tokens;
+            tokens_spent += tokens;
+            auto it = entries.find(key);
+            if (it != entries.end()) {
+                it->second->ready = true;
+                it->second->ok = ok;
+                it->second->body = body;
+                it->second->tokens = tokens;
+                if (!ok) {
+                    failed++;
+                    tokens_wasted += tokens;
+                    entries.erase(it);
+                }
+            }
+        }
+        ready_cond.notify_all();
+    }
+
+    // Take the response cached for `key`, waiting up to `wait` for one still
+    // in flight. Returns false on a miss.
+    bool take(const std::string& key, std::string& body, std::chrono::seconds wait) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            return false;
+        }
+        std::shared_ptr<Entry> entry = it->second;
+        bool waited = !entry->ready;
+        if (waited && !ready_cond.wait_for(lock, wait, [&]() { return entry->ready; })) {
+            return false;
+        }
+        // Another request for the same key may have taken it while we waited
+        it = entries.find(key);
+        if (!entry->ok || it == entries.end() || it->second != entry) {
+            return false;
+        }
+        entries.erase(it);
+        hits++;
+        inflight_hits += waited;
+        tokens_used += entry->tokens;
+        body = std::move(entry->body);
+        return true;
+    }
+
+    // Drop finished entries older than `ttl`
+    void expire(std::chrono::seconds ttl) {
+        auto cutoff = std::chrono::steady_clock::now() - ttl;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = entries.begin(); it != entries.end(); ) {
+            if (it->second->ready && it->second->created < cutoff) {
+                expired++;
+                tokens_wasted += it->second->tokens;
+                it = entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void skippedBusy() {
+        skipped_busy.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    nlohmann::json toJson() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t settled = hits + expired + failed;
+        return {
+            {"issued", issued},
+            {"hits", hits},
+            {"inflight_hits", inflight_hits},
+            {"expired", expired},
+            {"failed", failed},
+            {"pending", entries.size()},
+            {"hit_rate", settled ? static_cast<double>(hits) / settled : 0.0},
+            {"tokens_spent", tokens_spent},
+            {"tokens_used", tokens_used},
+            {"tokens_wasted", tokens_wasted},
+            {"skipped_busy", skipped_busy.load(std::memory_order_relaxed)},
+            {"skipped_budget", skipped_budget.load(std::memory_order_relaxed)}
+        };
+    }
+};
+
+#endif // SPECULATIVE_PREFETCH_H
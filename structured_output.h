@@ -0,0 +1,1065 @@
+#ifndef STRUCTURED_OUTPUT_H
+#define STRUCTURED_OUTPUT_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cctype>
+#include <nlohmann/json.hpp>
+
+// The part of JSON Schema that can be checked while a document is still
+// arriving: type, properties, required, additionalProperties, items, enum,
+// const, min/maxLength, min/maxItems and minimum/maximum. Other keywords
+// ($ref, anyOf, pattern, ...) are not checked, so they never reject output.
+struct SchemaNode {
+    enum Type : unsigned {
+        Null = 1, Boolean = 2, Integer = 4, Number = 8, String = 16, Array = 32, Object = 64, Any = 127
+    };
+
+    unsigned types = Any;
+    std::map<std::string, std::unique_ptr<SchemaNode>> properties;
+    std::vector<std::string> required;
+    bool additional_allowed = true;
+    std::unique_ptr<SchemaNode> additional;  // schema for properties not listed, if given
+    std::unique_ptr<SchemaNode> items;
+    bool has_enum = false;
+    std::vector<nlohmann::json> enum_values;
+    std::vector<std::string> enum_strings;   // sorted, for prefix checks while a string streams in
+    size_t min_length = 0;
+    size_t max_length = std::numeric_limits<size_t>::max();
+    size_t min_items = 0;
+    size_t max_items = std::numeric_limits<size_t>::max();
+    double minimum = -std::numeric_limits<double>::infinity();
+    double maximum = std::numeric_limits<double>::infinity();
+
+    static unsigned parseType(const std::string& name) {
+        if (name == "null") return Null;
+        if (name == "boolean") return Boolean;
+        if (name == "integer") return Integer;
+        if (name == "number") return Number | Integer;
+        if (name == "string") return String;
+        if (name == "array") return Array;
+        if (name == "object") return Object;
+        throw std::invalid_argument("Unknown schema type: " + name);
+    }
+
+    static std::string typeNames(unsigned types) {
+        static const std::pair<unsigned, const char*> names[] = {
+            {Null, "null"}, {Boolean, "boolean"}, {Integer, "integer"}, {Number, "number"},
+            {String, "string"}, {Array, "array"}, {Object, "object"}};
+        std::string out;
+        for (const auto& name : names) {
+            if ((types & name.first) && !(name.first == Integer && (types & Number))) {
+                out += out.empty() ? "" : " or ";
+                out += name.second;
+            }
+        }
+        return out.empty() ? "nothing" : out;
+    }
+
+    // Throws std::invalid_argument on a malformed schema
+    static std::unique_ptr<SchemaNode> compile(const nlohmann::json& schema) {
+        auto node = std::unique_ptr<SchemaNode>(new SchemaNode());
+        if (schema.is_boolean()) {
+            node->types = schema.get<bool>() ? static_cast<unsigned>(Any) : 0u;
+            return node;
+        }
+        if (!schema.is_object()) {
+            throw std::invalid_argument("Schema must be an object or a boolean");
+        }
+
+        if (schema.contains("type")) {
+            const nlohmann::json& type = schema["type"];
+            node->types = 0;
+            if (type.is_string()) {
+                node->types = parseType(type);
+            } else if (type.is_array()) {
+                for (const auto& name : type) {
+                    if (!name.is_string()) throw std::invalid_argument("Schema type must be a string");
+                    node->types |= parseType(name);
+                }
+            } else {
+                throw std::invalid_argument("Schema type must be a string or an array");
+            }
+        }
+        if (schema.contains("properties")) {
+            if (!schema["properties"].is_object()) throw std::invalid_argument("properties must be an object");
+            for (const auto& property : schema["properties"].items()) {
+                node->properties[property.key()] = compile(property.value());
+            }
+        }
+        if (schema.contains("required")) {
+            const nlohmann::json& required = schema["required"];
+            if (!required.is_array()) throw std::invalid_argument("required must be an array of strings");
+            for (const auto& name : required) {
+                if (!name.is_string()) throw std::invalid_argument("required must be an array of strings");
+                node->required.push_back(name);
+            }
+        }
+        if (schema.contains("additionalProperties")) {
+            const nlohmann::json& additional = schema["additionalProperties"];
+            if (additional.is_boolean()) {
+                node->additional_allowed = additional.get<bool>();
+            } else {
+                node->additional = compile(additional);
+            }
+        }
+        if (schema.contains("items") && schema["items"].is_object()) {
+            node->items = compile(schema["items"]);
+        }
+
+        std::vector<nlohmann::json> allowed;
+        if (schema.contains("enum")) {
+            if (!schema["enum"].is_array()) throw std::invalid_argument("enum must be an array");
+            allowed.assign(schema["enum"].begin(), schema["enum"].end());
+            node->has_enum = true;
+        }
+        if (schema.contains("const")) {
+            allowed.assign(1, schema["const"]);
+            node->has_enum = true;
+        }
+        for (const auto& value : allowed) {
+            if (value.is_string()) node->enum_strings.push_back(value);
+            node->enum_values.push_back(value);
+        }
+        std::sort(node->enum_strings.begin(), node->enum_strings.end());
+
+        node->min_length = sizeKeyword(schema, "minLength", node->min_length);
+        node->max_length = sizeKeyword(schema, "maxLength", node->max_length);
+        node->min_items = sizeKeyword(schema, "minItems", node->min_items);
+        node->max_items = sizeKeyword(schema, "maxItems", node->max_items);
+        node->minimum = numberKeyword(schema, "minimum", node->minimum);
+        node->maximum = numberKeyword(schema, "maximum", node->maximum);
+        return node;
+    }
+
+    static size_t sizeKeyword(const nlohmann::json& schema, const char* name, size_t fallback) {
+        if (!schema.contains(name)) return fallback;
+        if (!schema[name].is_number_unsigned()) {
+            throw std::invalid_argument(std::string(name) + " must be a non-negative integer");
+        }
+        return schema[name].get<size_t>();
+    }
+
+    static double numberKeyword(const nlohmann::json& schema, const char* name, double fallback) {
+        if (!schema.contains(name)) return fallback;
+        if (!schema[name].is_number()) {
+            throw std::invalid_argument(std::string(name) + " must be a number");
+        }
+        return schema[name].get<double>();
+    }
+
+    bool enumContains(const nlohmann::json& value) const {
+        return std::find(enum_values.begin(), enum_values.end(), value) != enum_values.end();
+    }
+};
+
+// Push parser that validates one JSON document against a SchemaNode as its
+// bytes arrive, in fragments of any size. A violation is reported at the
+// first byte that makes it certain: a wrong type at the value's first
+// character, an unknown property or enum value as soon as no allowed name
+// has the prefix received so far, a length or item limit when exceeded.
+// Only what is needed for these checks is buffered (the current string or
+// number), so memory stays bounded by the longest scalar.
+class StreamingJsonValidator {
+private:
+    static constexpr size_t kMaxDepth = 256;
+
+    enum class Expect { Value, KeyOrEnd, Key, Colon, CommaOrEnd, ValueOrEnd, Done };
+    enum class Token { None, String, Number, Literal };
+
+    struct Frame {
+        const SchemaNode* schema;
+        bool object;
+        Expect expect;
+        size_t count = 0;  // members or items so far
+        std::string key;
+        const SchemaNode* member_schema = nullptr;
+        std::vector<bool> required_seen;
+
+        Frame(const SchemaNode* schema, bool object)
+            : schema(schema), object(object), expect(object ? Expect::KeyOrEnd : Expect::ValueOrEnd) {}
+    };
+
+    const SchemaNode* root;
+    std::vector<Frame> stack;
+    Expect top = Expect::Value;
+
+    Token token = Token::None;
+    bool token_is_key = false;
+    const SchemaNode* token_schema = nullptr;
+    std::string text;        // decoded string or number text of the current token
+    size_t text_chars = 0;   // code points in `text`, for string lengths
+    int escape = 0;          // 1 after a backslash, 2-5 while reading \uXXXX digits
+    uint32_t code_unit = 0;
+    uint32_t high_surrogate = 0;
+    const char* literal = nullptr;
+    size_t literal_pos = 0;
+    int number_state = 0;
+
+    size_t consumed = 0;
+    std::string error_;
+    std::string error_path;
+
+    // `in_member` is false for errors about the innermost object or array
+    // itself (a property name, a missing property) rather than one of its values
+    bool fail(const std::string& message, bool in_member = true) {
+        error_ = message;
+        size_t depth = in_member || stack.empty() ? stack.size() : stack.size() - 1;
+        for (size_t i = 0; i < depth; i++) {
+            const Frame& frame = stack[i];
+            if (frame.count == 0) break;
+            error_path += "/" + (frame.object ? frame.key : std::to_string(frame.count - 1));
+        }
+        if (error_path.empty()) error_path = "/";
+        return false;
+    }
+
+    const SchemaNode* valueSchema() const {
+        if (stack.empty()) return root;
+        const Frame& frame = stack.back();
+        if (frame.object) return frame.member_schema;
+        return frame.schema ? frame.schema->items.get() : nullptr;
+    }
+
+    Expect& expect() {
+        return stack.empty() ? top : stack.back().expect;
+    }
+
+    bool startValue(char c, const SchemaNode* schema) {
+        unsigned type;
+        switch (c) {
+            case '{': type = SchemaNode::Object; break;
+            case '[': type = SchemaNode::Array; break;
+            case '"': type = SchemaNode::String; break;
+            case 't': case 'f': type = SchemaNode::Boolean; break;
+            case 'n': type = SchemaNode::Null; break;
+            default:
+                if (c == '-' || (c >= '0' && c <= '9')) {
+                    type = SchemaNode::Number | SchemaNode::Integer;
+                } else {
+                    return fail(std::string("unexpected character '") + c + "'");
+                }
+        }
+
+        if (!stack.empty() && !stack.back().object) {
+            Frame& array = stack.back();
+            array.count++;
+            if (array.schema && array.count > array.schema->max_items) {
+                return fail("more than " + std::to_string(array.schema->max_items) + " items");
+            }
+        }
+        if (schema && !(schema->types & type)) {
+            return fail("expected " + SchemaNode::typeNames(schema->types) +
+                        ", got " + SchemaNode::typeNames(type & ~SchemaNode::Integer ? type : SchemaNode::Number));
+        }
+        expect() = stack.empty() ? Expect::Done : Expect::CommaOrEnd;
+
+        switch (c) {
+            case '{':
+            case '[':
+                if (stack.size() >= kMaxDepth) return fail("nested too deeply");
+                stack.emplace_back(schema, c == '{');
+                if (c == '{' && schema) stack.back().required_seen.assign(schema->required.size(), false);
+                return true;
+            case '"':
+                startString(false, schema);
+                return true;
+            case 't': case 'f': case 'n':
+                token = Token::Literal;
+                token_schema = schema;
+                literal = c == 't' ? "true" : c == 'f' ? "false" : "null";
+                literal_pos = 1;
+                return true;
+            default:
+                token = Token::Number;
+                token_schema = schema;
+                text.assign(1, c);
+                number_state = c == '-' ? 1 : c == '0' ? 2 : 3;
+                return true;
+        }
+    }
+
+    void startString(bool key, const SchemaNode* schema) {
+        token = Token::String;
+        token_is_key = key;
+        token_schema = schema;
+        text.clear();
+        text_chars = 0;
+        escape = 0;
+        high_surrogate = 0;
+    }
+
+    void appendCodePoint(uint32_t cp) {
+        if (cp < 0x80) {
+            text += static_cast<char>(cp);
+        } else if (cp < 0x800) {
+            text += static_cast<char>(0xC0 | (cp >> 6));
+            text += static_cast<char>(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            text += static_cast<char>(0xE0 | (cp >> 12));
+            text += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            text += static_cast<char>(0x80 | (cp & 0x3F));
+        } else {
+            text += static_cast<char>(0xF0 | (cp >> 18));
+            text += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            text += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            text += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+        text_chars++;
+    }
+
+    static bool hasPrefix(const std::vector<std::string>& sorted, const std::string& prefix) {
+        auto it = std::lower_bound(sorted.begin(), sorted.end(), prefix);
+        return it != sorted.end() && it->compare(0, prefix.size(), prefix) == 0;
+    }
+
+    // Checks that can fail before the string ends
+    bool checkStringSoFar() {
+        if (token_is_key) {
+            const SchemaNode* schema = stack.back().schema;
+            if (schema && !schema->additional_allowed) {
+                auto it = schema->properties.lower_bound(text);
+                if (it == schema->properties.end() || it->first.compare(0, text.size(), text) != 0) {
+                    return fail("unexpected property \"" + text + "\"", false);
+                }
+            }
+            return true;
+        }
+        if (!token_schema) return true;
+        if (text_chars > token_schema->max_length) {
+            return fail("string longer than " + std::to_string(token_schema->max_length) + " characters");
+        }
+        if (token_schema->has_enum && !hasPrefix(token_schema->enum_strings, text)) {
+            return fail("\"" + text + "...\" is not one of the allowed values");
+        }
+        return true;
+    }
+
+    bool stringByte(char c) {
+        if (escape == 0) {
+            if (c == '"') {
+                if (high_surrogate) appendCodePoint(0xFFFD);
+                return endString();
+            }
+            if (c == '\\') {
+                escape = 1;
+                return true;
+            }
+            if (static_cast<unsigned char>(c) < 0x20) {
+                return fail("control character in string");
+            }
+            if (high_surrogate) {
+                appendCodePoint(0xFFFD);
+                high_surrogate = 0;
+            }
+            text += c;
+            if ((c & 0xC0) != 0x80) text_chars++;
+            return checkStringSoFar();
+        }
+
+        if (escape == 1) {
+            char decoded;
+            switch (c) {
+                case '"': case '\\': case '/': decoded = c; break;
+                case 'b': decoded = '\b'; break;
+                case 'f': decoded = '\f'; break;
+                case 'n': decoded = '\n'; break;
+                case 'r': decoded = '\r'; break;
+                case 't': decoded = '\t'; break;
+                case 'u':
+                    escape = 2;
+                    code_unit = 0;
+                    return true;
+                default:
+                    return fail(std::string("invalid escape '\\") + c + "'");
+            }
+            escape = 0;
+            if (high_surrogate) {
+                appendCodePoint(0xFFFD);
+                high_surrogate = 0;
+            }
+            appendCodePoint(static_cast<unsigned char>(decoded));
+            return checkStringSoFar();
+        }
+
+        int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                    c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (digit < 0) {
+            return fail("invalid \\u escape");
+        }
+        code_unit = code_unit << 4 | digit;
+        if (++escape < 6) {
+            return true;
+        }
+        escape = 0;
+        if (code_unit >= 0xD800 && code_unit < 0xDC00) {
+            if (high_surrogate) appendCodePoint(0xFFFD);
+            high_surrogate = code_unit;
+            return true;
+        }
+        if (code_unit >= 0xDC00 && code_unit < 0xE000) {
+            appendCodePoint(high_surrogate ? 0x10000 + ((high_surrogate - 0xD800) << 10) + (code_unit - 0xDC00) : 0xFFFD);
+        } else {
+            if (high_surrogate) appendCodePoint(0xFFFD);
+            appendCodePoint(code_unit);
+        }
+        high_surrogate = 0;
+        return checkStringSoFar();
+    }
+
+    bool endString() {
+        token = Token::None;
+        if (token_is_key) {
+            Frame& frame = stack.back();
+            frame.key = text;
+            frame.count++;
+            frame.expect = Expect::Colon;
+            frame.member_schema = nullptr;
+            if (!frame.schema) {
+                return true;
+            }
+            auto property = frame.schema->properties.find(text);
+            if (property != frame.schema->properties.end()) {
+                frame.member_schema = property->second.get();
+                for (size_t i = 0; i < frame.schema->required.size(); i++) {
+                    if (frame.schema->required[i] == text) frame.required_seen[i] = true;
+                }
+            } else if (!frame.schema->additional_allowed) {
+                return fail("unexpected property \"" + text + "\"", false);
+            } else {
+                frame.member_schema = frame.schema->additional.get();
+            }
+            return true;
+        }
+
+        if (token_schema) {
+            if (text_chars < token_schema->min_length) {
+                return fail("string shorter than " + std::to_string(token_schema->min_length) + " characters");
+            }
+            if (token_schema->has_enum && !token_schema->enumContains(text)) {
+                return fail("\"" + text + "\" is not one of the allowed values");
+            }
+        }
+        return true;
+    }
+
+    // Returns false when `c` does not continue the number
+    bool numberByte(char c) {
+        bool digit = c >= '0' && c <= '9';
+        int next = -1;
+        switch (number_state) {
+            case 1: next = c == '0' ? 2 : digit ? 3 : -1; break;
+            case 2: next = c == '.' ? 4 : (c == 'e' || c == 'E') ? 6 : -1; break;
+            case 3: next = digit ? 3 : c == '.' ? 4 : (c == 'e' || c == 'E') ? 6 : -1; break;
+            case 4: next = digit ? 5 : -1; break;
+            case 5: next = digit ? 5 : (c == 'e' || c == 'E') ? 6 : -1; break;
+            case 6: next = (c == '+' || c == '-') ? 7 : digit ? 8 : -1; break;
+            case 7: next = digit ? 8 : -1; break;
+            case 8: next = digit ? 8 : -1; break;
+        }
+        if (next < 0) {
+            return false;
+        }
+        number_state = next;
+        text += c;
+        return true;
+    }
+
+    bool endNumber() {
+        token = Token::None;
+        if (number_state != 2 && number_state != 3 && number_state != 5 && number_state != 8) {
+            return fail("malformed number \"" + text + "\"");
+        }
+        if (!token_schema) {
+            return true;
+        }
+        double value = std::strtod(text.c_str(), nullptr);
+        if (!(token_schema->types & SchemaNode::Number) && value != std::floor(value)) {
+            return fail("expected integer, got " + text);
+        }
+        if (value < token_schema->minimum || value > token_schema->maximum) {
+            return fail(text + " is out of range");
+        }
+        if (token_schema->has_enum) {
+            // A number too large for a double, like 1e999, matches no enum value
+            nlohmann::json number = nlohmann::json::parse(text, nullptr, false);
+            if (number.is_discarded() || !token_schema->enumContains(number)) {
+                return fail(text + " is not one of the allowed values");
+            }
+        }
+        return true;
+    }
+
+    bool literalByte(char c) {
+        if (c != literal[literal_pos]) {
+            return fail("invalid literal");
+        }
+        if (literal[++literal_pos] != '\0') {
+            return true;
+        }
+        token = Token::None;
+        if (token_schema && token_schema->has_enum) {
+            nlohmann::json value = literal[0] == 'n' ? nlohmann::json() : nlohmann::json(literal[0] == 't');
+            if (!token_schema->enumContains(value)) {
+                return fail(std::string(literal) + " is not one of the allowed values");
+            }
+        }
+        return true;
+    }
+
+    bool closeObject() {
+        const Frame& frame = stack.back();
+        if (frame.schema) {
+            for (size_t i = 0; i < frame.required_seen.size(); i++) {
+                if (!frame.required_seen[i]) {
+                    return fail("missing required property \"" + frame.schema->required[i] + "\"", false);
+                }
+            }
+        }
+        stack.pop_back();
+        return true;
+    }
+
+    bool closeArray() {
+        const Frame& frame = stack.back();
+        if (frame.schema && frame.count < frame.schema->min_items) {
+            return fail("fewer than " + std::to_string(frame.schema->min_items) + " items", false);
+        }
+        stack.pop_back();
+        return true;
+    }
+
+    bool structural(char c) {
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            return true;
+        }
+        Expect& state = expect();
+        switch (state) {
+            case Expect::Done:
+                return fail("unexpected data after the JSON value");
+            case Expect::Value:
+                return startValue(c, valueSchema());
+            case Expect::ValueOrEnd:
+                return c == ']' ? closeArray() : startValue(c, valueSchema());
+            case Expect::KeyOrEnd:
+                if (c == '}') return closeObject();
+                // fall through
+            case Expect::Key:
+                if (c != '"') return fail("expected a property name", false);
+                startString(true, nullptr);
+                return true;
+            case Expect::Colon:
+                if (c != ':') return fail("expected ':'", false);
+                state = Expect::Value;
+                return true;
+            case Expect::CommaOrEnd: {
+                bool object = stack.back().object;
+                if (c == ',') {
+                    state = object ? Expect::Key : Expect::Value;
+                    return true;
+                }
+                if (c == (object ? '}' : ']')) {
+                    return object ? closeObject() : closeArray();
+                }
+                return fail(object ? "expected ',' or '}'" : "expected ',' or ']'", false);
+            }
+        }
+        return true;
+    }
+
+public:
+    // `schema` may be null to accept any JSON document; it must outlive the validator
+    explicit StreamingJsonValidator(const SchemaNode* schema) : root(schema) {}
+
+    // Returns false from the first violation on
+    bool feed(const char* data, size_t size) {
+        if (!error_.empty()) {
+            return false;
+        }
+        for (size_t i = 0; i < size; i++, consumed++) {
+            char c = data[i];
+            switch (token) {
+                case Token::String:
+                    if (!stringByte(c)) return false;
+                    continue;
+                case Token::Literal:
+                    if (!literalByte(c)) return false;
+                    continue;
+                case Token::Number:
+                    if (numberByte(c)) continue;
+                    if (!endNumber()) return false;
+                    break;
+                case Token::None:
+                    break;
+            }
+            if (!structural(c)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool feed(const std::string& data) {
+        return feed(data.data(), data.size());
+    }
+
+    // The document has ended; false if it is incomplete or invalid
+    bool finish() {
+        if (!error_.empty()) {
+            return false;
+        }
+        if (token == Token::Number && !endNumber()) {
+            return false;
+        }
+        if (token != Token::None || !stack.empty() || top != Expect::Done) {
+            return fail("unexpected end of JSON");
+        }
+        return true;
+    }
+
+    bool failed() const { return !error_.empty(); }
+    const std::string& error() const { return error_; }
+    // JSON pointer to the value being parsed when validation failed
+    const std::string& errorPath() const { return error_path; }
+    // Bytes accepted before the violation, or in total
+    size_t offset() const { return consumed; }
+};
+
+// Tool definitions, tool_choice and response_format from a chat request,
+// with the schemas that constrain the model's output compiled once.
+class StructuredOutput {
+private:
+    nlohmann::json tools;
+    nlohmann::json tool_choice;
+    nlohmann::json response_format;
+    std::map<std::string, std::unique_ptr<SchemaNode>> tool_schemas;
+    std::unique_ptr<SchemaNode> content_schema;
+
+public:
+    // Null if the request uses none of the three fields. Throws
+    // std::invalid_argument when a definition is malformed.
+    static std::shared_ptr<const StructuredOutput> fromRequest(const nlohmann::json& request) {
+        // Fields of the wrong JSON type are malformed definitions too
+        try {
+            bool has_tools = request.contains("tools") && !(request["tools"].is_array() && request["tools"].empty());
+            if (!has_tools && !request.contains("tool_choice") && !request.contains("response_format")) {
+                return nullptr;
+            }
+
+            auto structured = std::make_shared<StructuredOutput>();
+            if (has_tools) {
+                if (!request["tools"].is_array()) {
+                    throw std::invalid_argument("tools must be an array");
+                }
+                structured->tools = request["tools"];
+                for (const auto& tool : structured->tools) {
+                    if (!tool.is_object() || (tool.contains("type") && tool["type"] != "function") ||
+                        !tool.contains("function") || !tool["function"].is_object() ||
+                        !tool["function"].contains("name") || !tool["function"]["name"].is_string()) {
+                        throw std::invalid_argument("Each tool must be {\"type\": \"function\", \"function\": {\"name\": ...}}");
+                    }
+                    const nlohmann::json& function = tool["function"];
+                    // Arguments are always a JSON object, even without a parameters schema
+                    std::unique_ptr<SchemaNode> schema = function.contains("parameters")
+                        ? SchemaNode::compile(function["parameters"]) : std::unique_ptr<SchemaNode>(new SchemaNode());
+                    schema->types &= SchemaNode::Object;
+                    structured->tool_schemas[function["name"]] = std::move(schema);
+                }
+            }
+            if (request.contains("tool_choice")) {
+                const nlohmann::json& choice = request["tool_choice"];
+                if (!choice.is_string() && !choice.is_object()) {
+                    throw std::invalid_argument("tool_choice must be a string or an object");
+                }
+                structured->tool_choice = choice;
+            }
+            if (request.contains("response_format")) {
+                const nlohmann::json& format = request["response_format"];
+                std::string type = format.is_object() && format.contains("type") && format["type"].is_string()
+                    ? format["type"].get<std::string>() : "";
+                if (type == "json_schema") {
+                    if (!format.contains("json_schema") || !format["json_schema"].is_object() ||
+                        !format["json_schema"].contains("schema")) {
+                        throw std::invalid_argument("response_format json_schema needs {\"json_schema\": {\"schema\": ...}}");
+                    }
+                    structured->content_schema = SchemaNode::compile(format["json_schema"]["schema"]);
+                } else if (type == "json_object") {
+                    structured->content_schema.reset(new SchemaNode());
+                    structured->content_schema->types = SchemaNode::Object;
+                } else if (type != "text") {
+                    throw std::invalid_argument("response_format type must be text, json_object or json_schema");
+                }
+                structured->response_format = format;
+            }
+            return structured;
+        } catch (const nlohmann::json::exception& e) {
+            throw std::invalid_argument(std::string("Malformed tools or response_format: ") + e.what());
+        }
+    }
+
+    // Whether the output has anything to validate
+    bool validates() const {
+        return !tool_schemas.empty() || content_schema;
+    }
+
+    bool hasTool(const std::string& name) const {
+        return tool_schemas.count(name) > 0;
+    }
+
+    const SchemaNode* toolSchema(const std::string& name) const {
+        auto it = tool_schemas.find(name);
+        return it != tool_schemas.end() ? it->second.get() : nullptr;
+    }
+
+    // Schema for the message content, or null when content is free text
+    const SchemaNode* contentSchema() const {
+        return content_schema.get();
+    }
+
+    void addTo(nlohmann::json& payload) const {
+        if (!tools.is_null()) payload["tools"] = tools;
+        if (!tool_choice.is_null()) payload["tool_choice"] = tool_choice;
+        if (!response_format.is_null()) payload["response_format"] = response_format;
+    }
+
+    // The same fields as ",\"name\":value" members, for spliced payloads
+    std::string payloadMembers() const {
+        std::string members;
+        if (!response_format.is_null()) members += ",\"response_format\":" + response_format.dump();
+        if (!tool_choice.is_null()) members += ",\"tool_choice\":" + tool_choice.dump();
+        if (!tools.is_null()) members += ",\"tools\":" + tools.dump();
+        return members;
+    }
+};
+
+// Rebuilds a chat.completion from an upstream server-sent event stream.
+// Tool call argument fragments and JSON content are fed to a validator for
+// their schema as each event arrives; feed() returns false at the first
+// violation so the caller can drop the connection and stop generation. With
+// `incremental` off, the same checks run once the stream has ended.
+class ChatStreamAssembler {
+private:
+    struct ToolCall {
+        std::string id;
+        std::string name;
+        std::string arguments;
+        std::unique_ptr<StreamingJsonValidator> validator;
+    };
+
+    const StructuredOutput* structured;
+    bool incremental;
+    bool sniffed = false;
+    bool event_stream = false;
+    bool stream_done = false;
+    std::string pending;  // incomplete event stream line
+    std::string raw;      // a body that is not an event stream, e.g. an upstream error
+    nlohmann::json meta = nlohmann::json::object();
+    std::string content;
+    std::string finish_reason;
+    std::vector<ToolCall> tool_calls;
+    std::unique_ptr<StreamingJsonValidator> content_validator;
+    uint64_t bytes = 0;
+
+    std::string violation_;
+    nlohmann::json violation_detail;
+
+    bool violation(const std::string& target, const std::string& message, const std::string& path = "",
+                   size_t offset = 0) {
+        violation_ = target + (path.empty() ? "" : " at " + path) + ": " + message;
+        violation_detail = {
+            {"target", target}, {"path", path}, {"message", message}, {"offset", offset},
+            {"incremental", incremental && !stream_done}
+        };
+        return false;
+    }
+
+    bool validatorFailed(const std::string& target, const StreamingJsonValidator& validator) {
+        return violation(target, validator.error(), validator.errorPath(), validator.offset());
+    }
+
+    static std::string toolTarget(size_t index, const std::string& name) {
+        return "tool_calls[" + std::to_string(index) + "] " + name;
+    }
+
+    // Start validating a tool call once its name is known
+    bool startToolCall(size_t index) {
+        ToolCall& call = tool_calls[index];
+        if (!structured->hasTool(call.name)) {
+            return violation(toolTarget(index, call.name), "unknown tool");
+        }
+        call.validator.reset(new StreamingJsonValidator(structured->toolSchema(call.name)));
+        if (!call.validator->feed(call.arguments)) {
+            return validatorFailed(toolTarget(index, call.name), *call.validator);
+        }
+        return true;
+    }
+
+    bool handleEvent(const nlohmann::json& event) {
+        if (!event.is_object()) {
+            return true;
+        }
+        if (event.contains("error")) {
+            meta["error"] = event["error"];
+            return true;
+        }
+        for (const char* field : {"id", "created", "model", "system_fingerprint"}) {
+            if (event.contains(field) && !meta.contains(field)) meta[field] = event[field];
+        }
+        for (const char* field : {"usage", "time_info"}) {
+            if (event.contains(field) && event[field].is_object()) meta[field] = event[field];
+        }
+        if (!event.contains("choices") || !event["choices"].is_array() || event["choices"].empty()) {
+            return true;
+        }
+
+        const nlohmann::json& choice = event["choices"][0];
+        if (choice.contains("finish_reason") && choice["finish_reason"].is_string()) {
+            finish_reason = choice["finish_reason"];
+        }
+        if (!choice.contains("delta") || !choice["delta"].is_object()) {
+            return true;
+        }
+        const nlohmann::json& delta = choice["delta"];
+
+        if (delta.contains("content") && delta["content"].is_string()) {
+            const std::string& fragment = delta["content"].get_ref<const std::string&>();
+            content += fragment;
+            if (on_content) {
+                on_content(fragment);
+            }
+            if (content_validator && !content_validator->feed(fragment)) {
+                return validatorFailed("content", *content_validator);
+            }
+        }
+
+        if (delta.contains("tool_calls") && delta["tool_calls"].is_array()) {
+            for (const auto& fragment : delta["tool_calls"]) {
+                if (!fragment.is_object()) {
+                    return violation("tool_calls", "tool call delta is not an object");
+                }
+                size_t index = tool_calls.size();
+                if (fragment.contains("index")) {
+                    if (!fragment["index"].is_number_unsigned()) {
+                        return violation("tool_calls", "tool call index is not a non-negative integer");
+                    }
+                    index = fragment["index"].get<size_t>();
+                }
+                if (index > 1024) {
+                    return violation("tool_calls", "tool call index out of range");
+                }
+                if (index >= tool_calls.size()) {
+                    tool_calls.resize(index + 1);
+                }
+                ToolCall& call = tool_calls[index];
+                if (fragment.contains("id") && fragment["id"].is_string()) {
+                    call.id = fragment["id"];
+                }
+                if (!fragment.contains("function") || !fragment["function"].is_object()) {
+                    continue;
+                }
+                const nlohmann::json& function = fragment["function"];
+                if (function.contains("name") && function["name"].is_string() && call.name.empty()) {
+                    call.name = function["name"];
+                    if (incremental && structured && !startToolCall(index)) {
+                        return false;
+                    }
+                }
+                if (function.contains("arguments") && function["arguments"].is_string()) {
+                    const std::string& arguments = function["arguments"].get_ref<const std::string&>();
+                    call.arguments += arguments;
+                    if (call.validator && !call.validator->feed(arguments)) {
+                        return validatorFailed(toolTarget(index, call.name), *call.validator);
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    bool handleLine(std::string& line) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.compare(0, 5, "data:") != 0) {
+            return true;
+        }
+        size_t start = line.size() > 5 && line[5] == ' ' ? 6 : 5;
+        if (line.compare(start, std::string::npos, "[DONE]") == 0) {
+            return true;
+        }
+        return handleEvent(nlohmann::json::parse(line.begin() + start, line.end(), nullptr, false));
+    }
+
+public:
+    // Called with each content fragment as it arrives
+    std::function<void(const std::string&)> on_content;
+
+    // `structured` may be null to assemble without validating
+    ChatStreamAssembler(const StructuredOutput* structured, bool incremental)
+        : structured(structured), incremental(incremental) {
+        if (structured && incremental && structured->contentSchema()) {
+            content_validator.reset(new StreamingJsonValidator(structured->contentSchema()));
+        }
+    }
+
+    // Returns false once the output has violated its schema
+    bool feed(const char* data, size_t size) {
+        if (failed()) {
+            return false;
+        }
+        bytes += size;
+        if (!sniffed) {
+            size_t first = 0;
+            while (first < size && std::isspace(static_cast<unsigned char>(data[first]))) first++;
+            if (first == size) {
+                return true;
+            }
+            sniffed = true;
+            event_stream = data[first] != '{' && data[first] != '[';
+        }
+        if (!event_stream) {
+            raw.append(data, size);
+            return true;
+        }
+
+        pending.append(data, size);
+        size_t start = 0, newline;
+        while ((newline = pending.find('\n', start)) != std::string::npos) {
+            std::string line = pending.substr(start, newline - start);
+            start = newline + 1;
+            if (!handleLine(line)) {
+                return false;
+            }
+        }
+        pending.erase(0, start);
+        return true;
+    }
+
+    // The stream has ended. Completes validation; false on a violation.
+    bool finish() {
+        if (failed()) {
+            return false;
+        }
+        stream_done = true;
+        if (!pending.empty()) {
+            std::string line;
+            line.swap(pending);
+            if (!handleLine(line)) {
+                return false;
+            }
+        }
+        if (!event_stream || !structured || meta.contains("error")) {
+            return true;
+        }
+
+        for (size_t i = 0; i < tool_calls.size(); i++) {
+            ToolCall& call = tool_calls[i];
+            if (!call.validator) {
+                if (call.name.empty()) {
+                    return violation(toolTarget(i, ""), "tool call without a name");
+                }
+                if (!startToolCall(i)) {
+                    return false;
+                }
+            }
+            if (!call.validator->finish()) {
+                return validatorFailed(toolTarget(i, call.name), *call.validator);
+            }
+        }
+        if (structured->contentSchema() && !(content.empty() && !tool_calls.empty())) {
+            if (!content_validator) {
+                content_validator.reset(new StreamingJsonValidator(structured->contentSchema()));
+                content_validator->feed(content);
+            }
+            if (!content_validator->finish()) {
+                return validatorFailed("content", *content_validator);
+            }
+        }
+        return true;
+    }
+
+    // Record a failure found outside the validators, such as an exception
+    // thrown while handling a chunk, so the transfer can be aborted like a
+    // schema violation. Always returns false.
+    bool fail(const std::string& message) {
+        return violation("stream", message);
+    }
+
+    bool failed() const { return !violation_.empty(); }
+    const std::string& violation() const { return violation_; }
+    // {"target", "path", "message", "offset", "incremental"} for the first violation
+    const nlohmann::json& violationJson() const { return violation_detail; }
+
+    // False when the upstream answered with a plain JSON body instead of events
+    bool eventStream() const { return event_stream; }
+    const std::string& rawBody() const { return raw; }
+    uint64_t bytesReceived() const { return bytes; }
+
+    // The assembled non-streaming chat.completion (or {"error": ...})
+    nlohmann::json completion() const {
+        if (meta.contains("error")) {
+            return {{"error", meta["error"]}};
+        }
+        nlohmann::json message = {{"role", "assistant"}};
+        message["content"] = content.empty() && !tool_calls.empty() ? nlohmann::json() : nlohmann::json(content);
+        if (!tool_calls.empty()) {
+            nlohmann::json calls = nlohmann::json::array();
+            for (const ToolCall& call : tool_calls) {
+                calls.push_back({
+                    {"id", call.id}, {"type", "function"},
+                    {"function", {{"name", call.name}, {"arguments", call.arguments}}}
+                });
+            }
+            message["tool_calls"] = calls;
+        }
+
+        nlohmann::json completion = meta;
+        completion["object"] = "chat.completion";
+        completion["choices"] = nlohmann::json::array({{
+            {"index", 0},
+            {"message", message},
+            {"finish_reason", finish_reason.empty() ? nlohmann::json() : nlohmann::json(finish_reason)}
+        }});
+        return completion;
+    }
+};
+
+// Outcomes of validated requests, for /api/stats
+struct StructuredOutputStats {
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> violations{0};
+    std::atomic<uint64_t> aborted_early{0};  // violations found while the upstream was still generating
+    std::atomic<uint64_t> bytes_streamed{0};
+
+    void record(const ChatStreamAssembler& assembler) {
+        requests.fetch_add(1, std::memory_order_relaxed);
+        bytes_streamed.fetch_add(assembler.bytesReceived(), std::memory_order_relaxed);
+        if (assembler.failed()) {
+            violations.fetch_add(1, std::memory_order_relaxed);
+            if (assembler.violationJson().value("incremental", false)) {
+                aborted_early.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    nlohmann::json toJson() const {
+        return {
+            {"requests", requests.load(std::memory_order_relaxed)},
+            {"violations", violations.load(std::memory_order_relaxed)},
+            {"aborted_early", aborted_early.load(std::memory_order_relaxed)},
+            {"bytes_streamed", bytes_streamed.load(std::memory_order_relaxed)}
+        };
+    }
+};
+
+#endif // STRUCTURED_OUTPUT_H